@@ -0,0 +1,164 @@
+// Host-side benchmark: links src/main.c against mock-api.c and pushes
+// synthetic PN532 command frames through the I2C callbacks, one command
+// at a time, reporting ns per bus byte and frames per second.
+//
+//   make bench                 # 1000000 frames per command
+//   dist/bench 200000          # custom frame count
+
+#include "mock-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_FRAMES 1000000
+#define BENCH_MAX_FRAME 300
+
+typedef struct {
+  const char *name;
+  uint8_t command[64];
+  uint8_t length;
+} bench_command_t;
+
+static uint8_t uid[4]; // Card 1, from InListPassiveTarget
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC); // C11; POSIX <time.h> would clash with the API's timer_t
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Host-to-PN532 information frame around command (command code + data)
+static int build_frame(uint8_t *frame, const uint8_t *command, int length) {
+  uint8_t sum = 0xD4;
+  int n = 0;
+  
+  frame[n++] = 0x00;
+  frame[n++] = 0x00;
+  frame[n++] = 0xFF;
+  frame[n++] = length + 1;
+  frame[n++] = -(length + 1);
+  frame[n++] = 0xD4;
+  for (int i = 0; i < length; i++) {
+    frame[n++] = command[i];
+    sum += command[i];
+  }
+  frame[n++] = -sum;
+  frame[n++] = 0x00;
+  return n;
+}
+
+static void i2c_write(const uint8_t *data, int length) {
+  mock_i2c.connect(mock_i2c.user_data, 0x24, false);
+  for (int i = 0; i < length; i++) {
+    mock_i2c.write(mock_i2c.user_data, data[i]);
+  }
+  mock_i2c.disconnect(mock_i2c.user_data);
+}
+
+// One read transaction: status byte, then a complete frame (ACK or response).
+// Returns the bytes moved on the bus, or -1 if the chip was not ready.
+static int i2c_read_frame(uint8_t *frame) {
+  int n = 0;
+  int length;
+  
+  mock_i2c.connect(mock_i2c.user_data, 0x24, true);
+  if ((mock_i2c.read(mock_i2c.user_data) & 0x01) == 0) {
+    mock_i2c.disconnect(mock_i2c.user_data);
+    return -1;
+  }
+  for (; n < 5; n++) {
+    frame[n] = mock_i2c.read(mock_i2c.user_data);
+  }
+  length = (frame[3] == 0) ? 6 : frame[3] + 7; // ACK, or LEN + TFI...DCS + postamble
+  for (; n < length && n < BENCH_MAX_FRAME; n++) {
+    frame[n] = mock_i2c.read(mock_i2c.user_data);
+  }
+  mock_i2c.disconnect(mock_i2c.user_data);
+  return n + 1;
+}
+
+// Send one command and read back its ACK and response; returns bus bytes,
+// or -1 if the chip was not ready for either read
+static int exchange(const uint8_t *frame, int frame_length, uint8_t *response) {
+  int ack, reply;
+  
+  i2c_write(frame, frame_length);
+  ack = i2c_read_frame(response);
+  reply = i2c_read_frame(response);
+  return (ack < 0 || reply < 0) ? -1 : frame_length + ack + reply;
+}
+
+static bool check_response(const bench_command_t *bench, const uint8_t *response) {
+  if (response[5] != 0xD5 || response[6] != bench->command[0] + 1) {
+    fprintf(stderr, "%s: unexpected response\n", bench->name);
+    return false;
+  }
+  return true;
+}
+
+static void run(const bench_command_t *bench, long frames) {
+  uint8_t frame[BENCH_MAX_FRAME];
+  uint8_t response[BENCH_MAX_FRAME];
+  int frame_length = build_frame(frame, bench->command, bench->length);
+  uint64_t bytes = 0;
+  uint64_t start;
+  double elapsed_ns;
+  
+  if (exchange(frame, frame_length, response) < 0 || !check_response(bench, response)) {
+    exit(1);
+  }
+  
+  start = now_ns();
+  for (long i = 0; i < frames; i++) {
+    int moved = exchange(frame, frame_length, response);
+    
+    // Every response is checked, so a chip that stops answering can't
+    // report a speed for frames it never produced
+    if (moved < 0 || !check_response(bench, response)) {
+      fprintf(stderr, "%s: failed at frame %ld\n", bench->name, i);
+      exit(1);
+    }
+    bytes += moved;
+  }
+  elapsed_ns = (double)(now_ns() - start);
+  
+  printf("%-24s %8.1f ns/frame %7.2f ns/byte %10.0f frames/s\n", bench->name,
+         elapsed_ns / frames, elapsed_ns / bytes, frames * 1e9 / elapsed_ns);
+}
+
+int main(int argc, char **argv) {
+  long frames = (argc > 1) ? atol(argv[1]) : BENCH_DEFAULT_FRAMES;
+  uint8_t frame[BENCH_MAX_FRAME];
+  uint8_t response[BENCH_MAX_FRAME];
+  const uint8_t in_list[] = { 0x4A, 0x01, 0x00 };
+  
+  mock_set_attr("log_level", 0);
+  mock_set_attr("timing_mode", 0); // Fast: responses are ready right after the ACK
+  mock_set_attr("card_index", 1);
+  chip_init();
+  
+  // Select card 1 once to learn its UID for the authentication frames
+  if (exchange(frame, build_frame(frame, in_list, sizeof(in_list)), response) < 0 || response[7] != 1) {
+    fprintf(stderr, "InListPassiveTarget: no card 1 to benchmark against\n");
+    return 1;
+  }
+  memcpy(uid, &response[13], sizeof(uid));
+  
+  bench_command_t benches[] = {
+    { "GetFirmwareVersion", { 0x02 }, 1 },
+    { "SAMConfiguration", { 0x14, 0x01, 0x14, 0x01 }, 4 },
+    { "InListPassiveTarget", { 0x4A, 0x01, 0x00 }, 3 },
+    { "MIFARE authenticate", { 0x40, 0x01, 0x60, 0x04, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+                               uid[0], uid[1], uid[2], uid[3] }, 14 },
+    { "MIFARE read", { 0x40, 0x01, 0x30, 0x04 }, 4 },
+    { "MIFARE write", { 0x40, 0x01, 0xA0, 0x04, 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                        0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF }, 20 },
+  };
+  
+  printf("%ld frames per command\n", frames);
+  for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    run(&benches[i], frames);
+  }
+  return 0;
+}
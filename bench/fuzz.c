@@ -0,0 +1,227 @@
+// Frame parser fuzz harness. Includes src/main.c to check the chip's buffer
+// and frame invariants after every host transaction. Each input is a list
+// of operations, one control byte each (kind in bits 7-6, n in bits 5-0):
+//   0  raw write transaction of the next n bytes
+//   1  the next n bytes as a command wrapped in a valid frame; n = 63 takes
+//      a 16-bit frame data length from the next two bytes (extended frames)
+//   2  read transaction of n + 1 bytes
+//   3  advance simulation time by n ms
+//
+//   make fuzz                # libFuzzer + ASan/UBSan (clang) on bench/corpus
+//   make fuzz-corpus         # any compiler: run the corpus, report ns/byte
+
+#include "mock-api.h"
+#include "../src/main.c"
+#include <time.h>
+
+#define FUZZ_OP_WRITE 0
+#define FUZZ_OP_COMMAND 1
+#define FUZZ_OP_READ 2
+#define FUZZ_OP_ADVANCE 3
+#define FUZZ_MAX_FRAME (PN532_MAX_FRAME_DATA + 16) // Also oversized frames
+
+static chip_state_t *chip;
+
+#define FUZZ_CHECK(condition) \
+  do { if (!(condition)) { fprintf(stderr, "Invariant failed: %s\n", #condition); abort(); } } while (0)
+
+static void fuzz_init(void) {
+  mock_set_attr("log_level", 0);
+  mock_set_attr("timing_mode", 1);
+  mock_set_attr("card_index", 1);
+  mock_set_attr("card_index2", 2);
+  chip_init();
+  chip = (chip_state_t *)mock_i2c.user_data;
+}
+
+// A frame the chip built: ACK, optionally followed by a frame whose length
+// and data checksums hold (LEN (+ LENM LENL) and TFI .. DCS)
+static void check_tx_frame(const response_slot_t *slot) {
+  static const uint8_t ack_packet[] = PN532_ACK_PACKET;
+  const uint8_t *tx = slot->data;
+  uint16_t length;
+  uint16_t data;
+  uint8_t sum = 0;
+  
+  FUZZ_CHECK(memcmp(tx, ack_packet, PN532_ACK_PACKET_SIZE) == 0);
+  if (slot->length == PN532_ACK_PACKET_SIZE) {
+    return;
+  }
+  tx += PN532_ACK_PACKET_SIZE;
+  FUZZ_CHECK(tx[0] == PN532_PREAMBLE && tx[1] == PN532_STARTCODE1 && tx[2] == PN532_STARTCODE2);
+  if (tx[3] == 0xFF && tx[4] == 0xFF) {
+    length = tx[5] << 8 | tx[6];
+    FUZZ_CHECK(((tx[5] + tx[6] + tx[7]) & 0xFF) == 0);
+    data = 8;
+  } else {
+    length = tx[3];
+    FUZZ_CHECK(((tx[3] + tx[4]) & 0xFF) == 0);
+    data = 5;
+  }
+  FUZZ_CHECK(PN532_ACK_PACKET_SIZE + data + length + 2 == slot->length);
+  for (uint16_t i = 0; i <= length; i++) {
+    sum += tx[data + i];
+  }
+  FUZZ_CHECK(sum == 0);
+  FUZZ_CHECK(tx[data + length + 1] == PN532_POSTAMBLE);
+}
+
+static void check_invariants(void) {
+  FUZZ_CHECK(chip->parser.state <= FRAME_STATE_POSTAMBLE);
+  FUZZ_CHECK(chip->parser.data_index <= PN532_MAX_FRAME_DATA);
+  FUZZ_CHECK(chip->command_length <= PN532_MAX_FRAME_DATA);
+  FUZZ_CHECK(chip->response_length <= PN532_MAX_FRAME_DATA);
+  FUZZ_CHECK(chip->command_queue_count <= PN532_COMMAND_QUEUE_DEPTH);
+  FUZZ_CHECK(chip->response_count <= PN532_RESPONSE_RING_DEPTH);
+  FUZZ_CHECK(chip->response_count > 0 || !chip->command_running);
+  FUZZ_CHECK(chip->tx_ready_length <= head_response(chip)->length);
+  FUZZ_CHECK(chip->tx_index <= chip->tx_ready_length);
+  FUZZ_CHECK(chip->irq_asserted == (chip->tx_index < chip->tx_ready_length || chip->wakeup_irq));
+  FUZZ_CHECK(chip->field_count <= MAX_FIELD_CARDS);
+  FUZZ_CHECK(chip->target_count <= PN532_MAX_TARGETS);
+  for (int i = 0; i < chip->response_count; i++) {
+    const response_slot_t *slot = &chip->responses[(chip->response_head + i) % PN532_RESPONSE_RING_DEPTH];
+    FUZZ_CHECK(slot->length <= PN532_TX_BUFFER_SIZE);
+    if (slot->length > 0) {
+      check_tx_frame(slot);
+    }
+  }
+}
+
+static void write_transaction(const uint8_t *data, size_t length) {
+  if (!mock_i2c.connect(mock_i2c.user_data, PN532_I2C_ADDRESS, false)) {
+    return; // NACK: powered down
+  }
+  for (size_t i = 0; i < length; i++) {
+    mock_i2c.write(mock_i2c.user_data, data[i]);
+  }
+  mock_i2c.disconnect(mock_i2c.user_data);
+}
+
+static void command_transaction(const uint8_t *command, size_t length) {
+  uint8_t frame[FUZZ_MAX_FRAME + 12];
+  uint16_t frame_length = length + 1; // TFI + command
+  uint8_t sum = PN532_HOSTTOPN532;
+  size_t n = 0;
+  
+  frame[n++] = PN532_PREAMBLE;
+  frame[n++] = PN532_STARTCODE1;
+  frame[n++] = PN532_STARTCODE2;
+  if (frame_length <= PN532_MAX_NORMAL_FRAME_LENGTH) {
+    frame[n++] = frame_length;
+    frame[n++] = -frame_length;
+  } else {
+    frame[n++] = 0xFF;
+    frame[n++] = 0xFF;
+    frame[n++] = frame_length >> 8;
+    frame[n++] = frame_length & 0xFF;
+    frame[n++] = -((frame_length >> 8) + (frame_length & 0xFF));
+  }
+  frame[n++] = PN532_HOSTTOPN532;
+  for (size_t i = 0; i < length; i++) {
+    frame[n++] = command[i];
+    sum += command[i];
+  }
+  frame[n++] = -sum;
+  frame[n++] = PN532_POSTAMBLE;
+  write_transaction(frame, n);
+}
+
+static void read_transaction(size_t length) {
+  if (!mock_i2c.connect(mock_i2c.user_data, PN532_I2C_ADDRESS, true)) {
+    return;
+  }
+  uint8_t status = mock_i2c.read(mock_i2c.user_data);
+  FUZZ_CHECK(status == PN532_I2C_READY || status == PN532_I2C_BUSY);
+  for (size_t i = 1; i < length; i++) {
+    mock_i2c.read(mock_i2c.user_data);
+  }
+  mock_i2c.disconnect(mock_i2c.user_data);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  size_t i = 0;
+  
+  if (chip == NULL) {
+    fuzz_init();
+  }
+  
+  // Start every input from an idle, awake chip
+  if (chip->powered_down) {
+    wake_up(chip, "the fuzzer");
+  }
+  chip->wakeup_irq = false;
+  chip->parser.state = FRAME_STATE_PREAMBLE;
+  abort_commands(chip);
+  
+  while (i < size) {
+    uint8_t kind = data[i] >> 6;
+    size_t n = data[i] & 0x3F;
+    i++;
+    
+    if (kind == FUZZ_OP_COMMAND && n == 0x3F) {
+      if (size - i < 2) {
+        break;
+      }
+      n = (data[i] << 8 | data[i + 1]) % (FUZZ_MAX_FRAME + 1);
+      i += 2;
+    }
+    if ((kind == FUZZ_OP_WRITE || kind == FUZZ_OP_COMMAND) && n > size - i) {
+      n = size - i;
+    }
+    
+    switch (kind) {
+      case FUZZ_OP_WRITE:
+        write_transaction(&data[i], n);
+        i += n;
+        break;
+      case FUZZ_OP_COMMAND:
+        command_transaction(&data[i], n);
+        i += n;
+        break;
+      case FUZZ_OP_READ:
+        read_transaction(n + 1);
+        break;
+      default:
+        mock_advance(n * 1e6);
+        break;
+    }
+    check_invariants();
+  }
+  return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+// Corpus runner without libFuzzer: every file given runs passes times, and
+// the total reports host bytes per second through the parser
+#define FUZZ_CORPUS_PASSES 2000
+
+int main(int argc, char **argv) {
+  static uint8_t input[1 << 16];
+  uint64_t bytes = 0;
+  struct timespec start, end;
+  
+  timespec_get(&start, TIME_UTC);
+  for (int f = 1; f < argc; f++) {
+    FILE *file = fopen(argv[f], "rb");
+    size_t size;
+    
+    if (file == NULL) {
+      fprintf(stderr, "Cannot open %s\n", argv[f]);
+      return 2;
+    }
+    size = fread(input, 1, sizeof(input), file);
+    fclose(file);
+    for (int pass = 0; pass < FUZZ_CORPUS_PASSES; pass++) {
+      LLVMFuzzerTestOneInput(input, size);
+    }
+    bytes += (uint64_t)size * FUZZ_CORPUS_PASSES;
+  }
+  timespec_get(&end, TIME_UTC);
+  
+  double elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("%d input(s), %llu bytes in %.1f ms (%.2f ns/input byte)\n", argc - 1,
+         (unsigned long long)bytes, elapsed_ns / 1e6, bytes > 0 ? elapsed_ns / bytes : 0.0);
+  return 0;
+}
+#endif
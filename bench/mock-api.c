@@ -0,0 +1,212 @@
+// Native stand-in for the Wokwi simulator imports in src/wokwi-api.h, just
+// enough to drive the chip from the bench/ harnesses. Timers only fire when
+// the harness advances simulation time; attributes keep their defaults
+// unless the harness sets them before chip_init().
+
+#include "wokwi-api.h"
+#include "mock-api.h"
+#include <string.h>
+
+#define MOCK_MAX_ATTRS 64
+#define MOCK_MAX_TIMERS 16
+#define MOCK_MAX_PINS 32
+
+typedef struct {
+  const char *name;
+  uint32_t value;
+} mock_attr_t;
+
+typedef struct {
+  timer_config_t config;
+  bool active;
+  double due_ns;
+  double period_ns;
+} mock_timer_t;
+
+i2c_config_t mock_i2c;
+spi_config_t mock_spi;
+uint8_t *mock_spi_buffer;
+uint32_t mock_spi_count;
+uart_config_t mock_uart;
+uint8_t mock_uart_tx[MOCK_UART_SINK_SIZE];
+uint32_t mock_uart_tx_length;
+static bool uart_busy; // A write whose write_done is still to come
+static mock_attr_t attrs[MOCK_MAX_ATTRS];
+static int attr_count;
+static mock_timer_t timers[MOCK_MAX_TIMERS];
+static int timer_count;
+static uint32_t pins[MOCK_MAX_PINS];
+static int pin_count;
+static mock_attr_t attr_overrides[MOCK_MAX_ATTRS];
+static int override_count;
+static double now_ns;
+
+void mock_set_attr(const char *name, uint32_t value) {
+  for (int i = 0; i < override_count; i++) {
+    if (strcmp(attr_overrides[i].name, name) == 0) {
+      attr_overrides[i].value = value;
+      return;
+    }
+  }
+  if (override_count < MOCK_MAX_ATTRS) {
+    attr_overrides[override_count].name = name;
+    attr_overrides[override_count++].value = value;
+  }
+}
+
+uint32_t attr_init(const char *name, uint32_t default_value) {
+  attrs[attr_count].name = name;
+  attrs[attr_count].value = default_value;
+  for (int i = 0; i < override_count; i++) {
+    if (strcmp(attr_overrides[i].name, name) == 0) {
+      attrs[attr_count].value = attr_overrides[i].value;
+    }
+  }
+  return attr_count++;
+}
+
+uint32_t attr_init_float(const char *name, float default_value) {
+  return attr_init(name, (uint32_t)default_value);
+}
+
+uint32_t attr_read(uint32_t attr_id) {
+  return attrs[attr_id].value;
+}
+
+float attr_read_float(uint32_t attr_id) {
+  return (float)attrs[attr_id].value;
+}
+
+pin_t pin_init(const char *name, uint32_t mode) {
+  pins[pin_count] = (mode == OUTPUT_HIGH || mode == INPUT_PULLUP) ? HIGH : LOW;
+  return pin_count++;
+}
+
+uint32_t pin_read(pin_t pin) {
+  return pins[pin];
+}
+
+void pin_write(pin_t pin, uint32_t value) {
+  pins[pin] = value;
+}
+
+bool pin_watch(pin_t pin, const pin_watch_config_t *config) {
+  return true;
+}
+
+void pin_watch_stop(pin_t pin) {
+}
+
+void pin_mode(pin_t pin, uint32_t value) {
+}
+
+float pin_adc_read(pin_t pin) {
+  return 0;
+}
+
+float pin_dac_write(pin_t pin, float voltage) {
+  return voltage;
+}
+
+i2c_dev_t i2c_init(const i2c_config_t *config) {
+  mock_i2c = *config;
+  return 1;
+}
+
+uart_dev_t uart_init(const uart_config_t *config) {
+  mock_uart = *config;
+  return 1;
+}
+
+// Accepts the bytes into the sink (dropping what doesn't fit); the write
+// completes on the next mock_advance(), as if the line were infinitely fast
+bool uart_write(uart_dev_t uart, uint8_t *buffer, uint32_t count) {
+  if (uart_busy) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count && mock_uart_tx_length < MOCK_UART_SINK_SIZE; i++) {
+    mock_uart_tx[mock_uart_tx_length++] = buffer[i];
+  }
+  uart_busy = true;
+  return true;
+}
+
+spi_dev_t spi_init(const spi_config_t *spi_config) {
+  mock_spi = *spi_config;
+  return 1;
+}
+
+void spi_start(const spi_dev_t spi, uint8_t *buffer, uint32_t count) {
+  mock_spi_buffer = buffer;
+  mock_spi_count = count;
+}
+
+void spi_stop(const spi_dev_t spi) {
+}
+
+timer_t timer_init(const timer_config_t *config) {
+  timers[timer_count].config = *config;
+  return timer_count++;
+}
+
+void timer_start(const timer_t timer, uint32_t micros, bool repeat) {
+  timer_start_ns_d(timer, micros * 1000.0, repeat);
+}
+
+void timer_start_ns_d(const timer_t timer, double nanos, bool repeat) {
+  timers[timer].active = true;
+  timers[timer].due_ns = now_ns + nanos;
+  timers[timer].period_ns = repeat ? nanos : 0;
+}
+
+void timer_stop(const timer_t timer) {
+  timers[timer].active = false;
+}
+
+double get_sim_nanos_d(void) {
+  return now_ns;
+}
+
+buffer_t framebuffer_init(uint32_t *pixel_width, uint32_t *pixel_height) {
+  *pixel_width = 0;
+  *pixel_height = 0;
+  return 0;
+}
+
+void buffer_read(buffer_t buffer, uint32_t offset, uint8_t *data, uint32_t data_len) {
+}
+
+void buffer_write(buffer_t buffer, uint32_t offset, uint8_t *data, uint32_t data_len) {
+}
+
+// Finish pending UART writes and run every timer that falls due within the
+// next nanos of simulation time
+void mock_advance(double nanos) {
+  double end_ns = now_ns + nanos;
+  
+  for (;;) {
+    int next = -1;
+    
+    while (uart_busy) {
+      uart_busy = false;
+      mock_uart.write_done(mock_uart.user_data); // May start the next write
+    }
+    for (int i = 0; i < timer_count; i++) {
+      if (timers[i].active && timers[i].due_ns <= end_ns &&
+          (next < 0 || timers[i].due_ns < timers[next].due_ns)) {
+        next = i;
+      }
+    }
+    if (next < 0) {
+      break;
+    }
+    now_ns = timers[next].due_ns;
+    if (timers[next].period_ns > 0) {
+      timers[next].due_ns += timers[next].period_ns;
+    } else {
+      timers[next].active = false;
+    }
+    timers[next].config.callback(timers[next].config.user_data);
+  }
+  now_ns = end_ns;
+}
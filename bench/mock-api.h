@@ -0,0 +1,25 @@
+#ifndef MOCK_API_H
+#define MOCK_API_H
+
+#include "wokwi-api.h"
+
+// I2C callbacks registered by the chip
+extern i2c_config_t mock_i2c;
+
+// SPI callbacks registered by the chip, and the transfer it started last
+extern spi_config_t mock_spi;
+extern uint8_t *mock_spi_buffer;
+extern uint32_t mock_spi_count;
+
+// UART callbacks registered by the chip, and everything it has written so
+// far (the harness empties the sink by resetting mock_uart_tx_length)
+#define MOCK_UART_SINK_SIZE 1024
+extern uart_config_t mock_uart;
+extern uint8_t mock_uart_tx[MOCK_UART_SINK_SIZE];
+extern uint32_t mock_uart_tx_length;
+
+// Attribute value for chip_init() to pick up instead of the default
+void mock_set_attr(const char *name, uint32_t value);
+void mock_advance(double nanos);
+
+#endif /* MOCK_API_H */
@@ -0,0 +1,121 @@
+// SPI transport regression checks. Includes src/main.c and plays the bus
+// master against the chip's SPI callbacks: every transfer the chip starts
+// is clocked byte by byte, and SS may rise in the middle of one, as when a
+// host reads a fixed buffer length. Exits non-zero on the first mismatch.
+//
+//   make spi-check
+
+#include "mock-api.h"
+#include "../src/main.c"
+
+static chip_state_t *chip;
+static int failures;
+
+static const uint8_t ack_frame[] = PN532_ACK_PACKET;
+static const uint8_t firmware_frame[] = {0x00, 0x00, 0xFF, 0x06, 0xFA, 0xD5, 0x03, 0x32, 0x01, 0x06, 0x07, 0xE8, 0x00};
+
+static void spi_select(void) {
+  on_spi_ss_change(chip, chip->pin_ss, LOW);
+}
+
+// One transaction: the prefix byte, then length bytes out of (or into) the
+// chip. busy_ns of simulation time pass once the first data transfer has
+// been loaded, before any of it is clocked.
+static void spi_transaction(uint8_t prefix, const uint8_t *out, uint8_t *in, size_t length, double busy_ns) {
+  size_t n = 0;
+  uint32_t taken;
+  
+  spi_select();
+  mock_spi_buffer[0] = spi_byte(chip, prefix);
+  mock_spi.done(chip, mock_spi_buffer, 1);
+  if (busy_ns > 0) {
+    mock_advance(busy_ns);
+  }
+  for (;;) {
+    uint8_t *buffer = mock_spi_buffer;
+    uint32_t count = mock_spi_count;
+    
+    taken = (length - n < count) ? length - n : count;
+    for (uint32_t i = 0; i < taken; i++) {
+      if (out != NULL) {
+        buffer[i] = spi_byte(chip, out[n + i]);
+      } else {
+        in[n + i] = spi_byte(chip, buffer[i]);
+      }
+    }
+    n += taken;
+    if (taken < count || n == length) {
+      break;
+    }
+    mock_spi.done(chip, buffer, count);
+  }
+  // SS high: the chip sees the transfer cut short (or complete)
+  on_spi_ss_change(chip, chip->pin_ss, HIGH);
+  mock_spi.done(chip, mock_spi_buffer, taken);
+}
+
+static void write_command(const uint8_t *command, size_t length) {
+  uint8_t frame[PN532_TX_BUFFER_SIZE];
+  uint8_t sum = PN532_HOSTTOPN532;
+  size_t n = 0;
+  
+  frame[n++] = PN532_PREAMBLE;
+  frame[n++] = PN532_STARTCODE1;
+  frame[n++] = PN532_STARTCODE2;
+  frame[n++] = length + 1;
+  frame[n++] = -(length + 1);
+  frame[n++] = PN532_HOSTTOPN532;
+  for (size_t i = 0; i < length; i++) {
+    frame[n++] = command[i];
+    sum += command[i];
+  }
+  frame[n++] = -sum;
+  frame[n++] = PN532_POSTAMBLE;
+  spi_transaction(PN532_SPI_DATAWRITE, frame, NULL, n, 0);
+}
+
+static void expect_read(const char *name, const uint8_t *expected, size_t length, size_t read_length, double busy_ns) {
+  uint8_t data[PN532_TX_BUFFER_SIZE];
+  
+  spi_transaction(PN532_SPI_DATAREAD, NULL, data, read_length, busy_ns);
+  if (memcmp(data, expected, length) != 0) {
+    printf("FAIL %s:", name);
+    for (size_t i = 0; i < read_length; i++) {
+      printf(" %02X", data[i]);
+    }
+    printf("\n");
+    failures++;
+  } else {
+    printf("ok   %s\n", name);
+  }
+}
+
+int main(void) {
+  static const uint8_t get_firmware_version[] = {PN532_COMMAND_GETFIRMWAREVERSION};
+  
+  mock_set_attr("log_level", 0);
+  mock_set_attr("interface", INTERFACE_SPI);
+  mock_set_attr("timing_mode", TIMING_MODE_REALISTIC);
+  chip_init();
+  chip = (chip_state_t *)mock_spi.user_data;
+  
+  // Filler clocked while the response is still being processed must not
+  // consume the response that becomes ready during the transfer
+  write_command(get_firmware_version, sizeof(get_firmware_version));
+  expect_read("ack", ack_frame, sizeof(ack_frame), sizeof(ack_frame), 0);
+  expect_read("busy read", (const uint8_t[7]){0}, 7, 7, 1e6);
+  expect_read("response after busy read", firmware_frame, sizeof(firmware_frame), sizeof(firmware_frame), 0);
+  
+  // A host that over-reads a fixed buffer length must not eat into the next
+  // queued command's ACK and response
+  write_command(get_firmware_version, sizeof(get_firmware_version));
+  write_command(get_firmware_version, sizeof(get_firmware_version));
+  mock_advance(1e6);
+  expect_read("first ack", ack_frame, sizeof(ack_frame), sizeof(ack_frame), 0);
+  expect_read("first response, over-read", firmware_frame, sizeof(firmware_frame), 16, 0);
+  mock_advance(1e6);
+  expect_read("second ack", ack_frame, sizeof(ack_frame), sizeof(ack_frame), 0);
+  expect_read("second response", firmware_frame, sizeof(firmware_frame), sizeof(firmware_frame), 0);
+  
+  return failures > 0;
+}
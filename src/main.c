@@ -3,14 +3,81 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Log levels
+#define LOG_LEVEL_OFF 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_TRACE 3
+
+// Compile-time log level (set with `make LOG_LEVEL=...`); anything above it compiles to nothing
+#ifndef PN532_LOG_LEVEL
+#define PN532_LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Runtime filter on top of the compile-time level (log_level attribute)
+#define LOG_AT(chip, level, ...) \
+  do { if ((chip)->log_level >= (level)) printf(__VA_ARGS__); } while (0)
+
+// Compiled-out levels still type-check their arguments, so variables and
+// helpers that only feed a log line don't turn into unused warnings
+#define LOG_NONE(chip, ...) \
+  do { if (0) { (void)(chip); printf(__VA_ARGS__); } } while (0)
+
+#if PN532_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(chip, ...) LOG_AT(chip, LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(chip, ...) LOG_NONE(chip, __VA_ARGS__)
+#endif
+
+#if PN532_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(chip, ...) LOG_AT(chip, LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(chip, ...) LOG_NONE(chip, __VA_ARGS__)
+#endif
+
+#if PN532_LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(chip, ...) LOG_AT(chip, LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(chip, ...) LOG_NONE(chip, __VA_ARGS__)
+#endif
+
 // I2C address
 #define PN532_I2C_ADDRESS 0x24
 
+// Host interfaces (interface attribute)
+#define INTERFACE_I2C 0
+#define INTERFACE_SPI 1
+#define INTERFACE_HSU 2
+
+// Default HSU baud rate
+#define DEFAULT_HSU_BAUD_RATE 115200
+
+// SPI transaction prefixes
+#define PN532_SPI_DATAWRITE 0x01
+#define PN532_SPI_STATREAD 0x02
+#define PN532_SPI_DATAREAD 0x03
+
+// SPI transaction phases
+#define SPI_PHASE_IDLE 0
+#define SPI_PHASE_PREFIX 1
+#define SPI_PHASE_STATUS 2
+#define SPI_PHASE_DATA_READ 3
+#define SPI_PHASE_DATA_WRITE 4
+
 // Command codes
 #define PN532_COMMAND_GETFIRMWAREVERSION 0x02
 #define PN532_COMMAND_SAMCONFIGURATION 0x14
 #define PN532_COMMAND_INLISTPASSIVETARGET 0x4A
 #define PN532_COMMAND_INDATAEXCHANGE 0x40
+#define PN532_COMMAND_INCOMMUNICATETHRU 0x42
+#define PN532_COMMAND_INRELEASE 0x52
+#define PN532_COMMAND_INSELECT 0x54
+#define PN532_COMMAND_RFCONFIGURATION 0x32
+#define PN532_COMMAND_POWERDOWN 0x16
+#define PN532_COMMAND_INAUTOPOLL 0x60
+#define PN532_COMMAND_TGINITASTARGET 0x8C
+#define PN532_COMMAND_TGGETDATA 0x86
+#define PN532_COMMAND_TGSETDATA 0x8E
 #define PN532_COMMAND_MIFARE_READ 0x30
 #define PN532_COMMAND_MIFARE_WRITE 0xA0
 
@@ -20,6 +87,30 @@
 #define PN532_RESPONSE_INLISTPASSIVETARGET (PN532_COMMAND_INLISTPASSIVETARGET + 1)
 #define PN532_RESPONSE_INDATAEXCHANGE (PN532_COMMAND_INDATAEXCHANGE + 1)
 
+// PowerDown WakeUpEnable bits. INT0 is the REQ pin on this board.
+#define WAKEUP_INT0 0x01
+#define WAKEUP_RF 0x08
+#define WAKEUP_HSU 0x10
+#define WAKEUP_SPI 0x20
+#define WAKEUP_I2C 0x80
+
+// Mifare Classic authentication commands (InDataExchange)
+#define MIFARE_CMD_AUTH_A 0x60
+#define MIFARE_CMD_AUTH_B 0x61
+
+// Vendor extension (InDataExchange): write a whole sector after one authentication
+#define MIFARE_CMD_WRITE_SECTOR 0xA8
+#define WRITE_SECTOR_DIVERSIFY_KEY_A 0x01 // Derive key A from the master key and the UID
+#define WRITE_SECTOR_DIVERSIFY_KEY_B 0x02 // Same for key B
+#define WRITE_SECTOR_LOAD_MASTER_KEY 0x80 // A new master key follows the sector data
+
+// Mifare Ultralight / NTAG2xx commands (InDataExchange)
+#define NTAG_CMD_GET_VERSION 0x60
+#define NTAG_CMD_READ 0x30
+#define NTAG_CMD_FAST_READ 0x3A
+#define NTAG_CMD_WRITE 0xA2
+#define NTAG_CMD_COMPATIBILITY_WRITE 0xA0
+
 // Constants
 #define PN532_PREAMBLE 0x00
 #define PN532_STARTCODE1 0x00
@@ -27,11 +118,75 @@
 #define PN532_POSTAMBLE 0x00
 #define PN532_HOSTTOPN532 0xD4
 #define PN532_PN532TOHOST 0xD5
+#define PN532_I2C_READY 0x01 // Status byte: data available
+#define PN532_I2C_BUSY 0x00  // Status byte: nothing to read yet
 #define PN532_ACK_PACKET_SIZE 6
 #define PN532_ACK_PACKET {0x00, 0x00, 0xFF, 0x00, 0xFF, 0x00}
+#define PN532_ERROR_PACKET_SIZE 8
+#define PN532_ERROR_PACKET {0x00, 0x00, 0xFF, 0x01, 0xFF, 0x7F, 0x81, 0x00} // Syntax error
+#define PN532_MAX_NORMAL_FRAME_LENGTH 255 // Largest LEN (TFI + data) of a normal frame
+#define PN532_MAX_FRAME_LENGTH 265 // Largest LEN (TFI + data) of an extended frame
+#define PN532_MAX_FRAME_DATA (PN532_MAX_FRAME_LENGTH - 1)
+#define PN532_EXT_FRAME_OVERHEAD 11 // Preamble, start codes, FF FF, LENM, LENL, LCS, TFI, DCS, postamble
+#define PN532_TX_BUFFER_SIZE (PN532_ACK_PACKET_SIZE + PN532_EXT_FRAME_OVERHEAD + PN532_MAX_FRAME_DATA)
+#define PN532_COMMAND_QUEUE_DEPTH 4 // Frames received while a command runs
+#define PN532_RESPONSE_RING_DEPTH 2 // The output the host reads and the one being built
+
+// Frame parser states
+#define FRAME_STATE_PREAMBLE 0
+#define FRAME_STATE_STARTCODE1 1
+#define FRAME_STATE_STARTCODE2 2
+#define FRAME_STATE_LENGTH 3
+#define FRAME_STATE_LENGTH_CHECKSUM 4
+#define FRAME_STATE_EXT_LENGTH_MSB 5
+#define FRAME_STATE_EXT_LENGTH_LSB 6
+#define FRAME_STATE_EXT_LENGTH_CHECKSUM 7
+#define FRAME_STATE_TFI 8
+#define FRAME_STATE_COMMAND 9
+#define FRAME_STATE_DATA 10
+#define FRAME_STATE_POSTAMBLE 11
 
-// Card types
-#define CARD_TYPE_MIFARE_CLASSIC 0x00
+// Card types (card_type attribute for cards without a dump)
+#define CARD_TYPE_MIFARE_CLASSIC 0x00 // Classic 1K
+#define CARD_TYPE_MIFARE_CLASSIC_4K 0x01
+#define CARD_TYPE_MIFARE_ULTRALIGHT 0x02
+#define CARD_TYPE_NTAG213 0x03
+#define CARD_TYPE_NTAG215 0x04
+#define CARD_TYPE_NTAG216 0x05
+#define CARD_TYPE_COUNT 6
+
+// Targets InListPassiveTarget can activate at once
+#define PN532_MAX_TARGETS 2
+#define PN532_ERROR_WRONG_TARGET 0x27 // Status: no such target
+
+// RFConfiguration items
+#define RFCONFIG_ITEM_MAX_RETRIES 0x05 // MxRtyATR, MxRtyPSL, MxRtyPassiveActivation
+#define PN532_RETRIES_FOREVER 0xFF     // Retry count / PollNr that never gives up
+
+// InAutoPoll target types answered by the virtual cards
+#define AUTOPOLL_TYPE_GENERIC_106 0x00 // Generic passive 106 kbps (ISO/IEC 14443-4A, Mifare, DEP)
+#define AUTOPOLL_TYPE_MIFARE 0x10
+#define AUTOPOLL_PERIOD_NS 150000000ULL // Unit of the InAutoPoll period
+
+// Target mode
+#define TARGET_MODE_OFF 0
+#define TARGET_MODE_WAITING 1 // TgInitAsTarget issued, no initiator yet
+#define TARGET_MODE_ACTIVE 2
+#define TG_MODE_PICC_ONLY 0x04 // TgInitAsTarget Mode: ISO/IEC 14443-4 card emulation only
+#define TG_ACTIVATED_DEP 0x04  // Activated at 106 kbps for DEP (P2P)
+#define TG_ACTIVATED_PICC 0x08 // Activated at 106 kbps as an ISO/IEC 14443-4 PICC
+#define PN532_STATUS_MORE_INFORMATION 0x40 // MI: the initiator's data goes on
+#define PN532_ERROR_INVALID_STATE 0x25     // Status: not activated as a target
+#define PN532_ERROR_RELEASED 0x29          // Status: released by the initiator
+#define PEER_RING_SIZE 2048                // Bytes of initiator frames queued ahead of TgGetData
+#define PEER_RING_FRAMES 32
+#define PEER_LINE_SIZE 1024
+
+// Cards that can be in the RF field together
+#define MAX_FIELD_CARDS 8
+
+// card_index / card_index2 controls
+#define CARD_INDEX_CONTROLS 2
 
 // Virtual card states
 #define CARD_STATE_ABSENT 0
@@ -39,65 +194,529 @@
 
 // Define UID sizes
 #define UID_SIZE_MIFARE_CLASSIC 4
+#define UID_SIZE_NTAG 7
+
+// First UID byte of 7-byte UIDs
+#define NXP_MANUFACTURER_ID 0x04
+
+// Card dump files (card_dumps attribute), relative to PN532_DUMP_DIR
+#ifndef PN532_DUMP_DIR
+#define PN532_DUMP_DIR ""
+#endif
+#define PN532_CARD_PACK_FILE "pn532-cards.bin"
+#define PN532_CARD_PACK_MAGIC "P5CK"
+
+// Card write journal (journal attribute), relative to PN532_DUMP_DIR
+#define PN532_JOURNAL_FILE "pn532-journal.bin"
+#define PN532_JOURNAL_TEMP_FILE "pn532-journal.tmp"
+#define PN532_JOURNAL_MAGIC "P5JN"
+#define JOURNAL_BLOCK_SIZE 16           // Card memory bytes per record
+#define JOURNAL_RECORD_SIZE 25          // UID length, UID (7), block, data (16)
+#define JOURNAL_COMPACT_RECORDS 1024    // Minimum appended records before compaction
+
+// Initiator script for target mode, relative to PN532_DUMP_DIR
+#define PN532_PEER_FILE "pn532-peer.txt"
+
+// I2C protocol trace (trace attribute), relative to PN532_DUMP_DIR
+#define PN532_TRACE_FILE "pn532-trace.bin"
+#define PN532_TRACE_MAGIC "P5TR"
+#define TRACE_WRITE 'W'              // Host write transaction
+#define TRACE_READ 'R'               // Host read transaction, status byte first
+#define TRACE_CONTINUED 0x20         // Kind flag: more of the previous record's transaction
+#define TRACE_MAX_RECORD 512         // Longer transactions span several records
+
+// Performance counters; compile them out with `make STATS=0`
+#ifndef PN532_STATS
+#define PN532_STATS 1
+#endif
+
+#if PN532_STATS
+#define STATS_ADD(chip, counter, n) ((chip)->stats.counter += (n))
+#else
+#define STATS_ADD(chip, counter, n) do { } while (0)
+#endif
+
+// Granularity of the cached card memory byte sums that make up response DCS
+#define CARD_SUM_BLOCK_SIZE 16
+
+// Response payload fragments: enough for one per block of the longest MIFARE read
+#define RESPONSE_MAX_FRAGMENTS 32
+
+// Latency histogram: bucket i counts responses under 2^i us, the last one the rest
+#define STATS_LATENCY_BUCKETS 16
 
-// Maximum number of virtual cards
-#define MAX_VIRTUAL_CARDS 2
+// Card presence timeline (timeline attribute), relative to PN532_DUMP_DIR
+#define PN532_TIMELINE_FILE "pn532-timeline.txt"
+#define TIMELINE_PLACE 0
+#define TIMELINE_REMOVE 1
+#define TIMELINE_CLEAR 2
 
-// Size of a Mifare Classic 1K card (in bytes)
+// Card registry size (card_count attribute)
+#define DEFAULT_CARD_COUNT 2
+#define MAX_CARD_COUNT 4096
+
+// First UID byte of cards beyond card 2
+#define GENERATED_UID_PREFIX 0x1A
+
+// Default card field sampling period (in microseconds, 0 = frame boundaries only)
+#define DEFAULT_FIELD_SAMPLE_US 10000
+
+// Response timing modes (timing_mode attribute)
+#define TIMING_MODE_FAST 0      // Assert IRQ as soon as the frame is processed
+#define TIMING_MODE_REALISTIC 1 // Assert IRQ after the per-command latency
+
+// Processing latencies (in nanoseconds) used by TIMING_MODE_REALISTIC
+#define LATENCY_SYNTAX_ERROR_NS 50000
+#define LATENCY_GETFIRMWAREVERSION_NS 100000
+#define LATENCY_SAMCONFIGURATION_NS 200000
+#define LATENCY_RFCONFIGURATION_NS 100000
+#define LATENCY_POWERDOWN_NS 100000
+#define LATENCY_INLISTPASSIVETARGET_NS 2500000 // REQA, anticollision and SELECT
+#define LATENCY_INLISTPASSIVETARGET_TIMEOUT_NS 30000000 // No card answered (per activation attempt)
+#define LATENCY_CARD_EXCHANGE_NS 150000 // InDataExchange / InCommunicateThru overhead
+#define LATENCY_MIFARE_AUTH_NS 3000000
+#define LATENCY_MIFARE_READ_NS 1000000 // Per block
+#define LATENCY_MIFARE_WRITE_NS 6000000 // EEPROM write time
+#define LATENCY_NTAG_READ_NS 500000
+#define LATENCY_NTAG_FAST_READ_PAGE_NS 340000 // 4 bytes on the air at 106 kbit/s
+#define LATENCY_NTAG_WRITE_NS 4100000
+
+// Card memory sizes (in bytes), also the size of a raw dump
 #define MIFARE_1K_SIZE 1024
+#define MIFARE_4K_SIZE 4096
+#define MIFARE_ULTRALIGHT_SIZE 64
+#define NTAG213_SIZE 180
+#define NTAG215_SIZE 540
+#define NTAG216_SIZE 924
+#define MAX_CARD_MEMORY_SIZE MIFARE_4K_SIZE
+
+// Card memory is copied on write in chunks of this many bytes
+#define CARD_CHUNK_SIZE 64
+
+// Mifare Classic geometry: 4-block sectors, then (4K only) 16-block sectors from block 128
 #define MIFARE_CLASSIC_BLOCK_SIZE 16
 #define MIFARE_CLASSIC_BLOCKS_PER_SECTOR 4
-#define MIFARE_CLASSIC_SECTOR_COUNT 16
+#define MIFARE_CLASSIC_SMALL_SECTORS 32
+#define MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS 16
+#define MIFARE_CLASSIC_1K_SECTORS 16
+#define MIFARE_CLASSIC_4K_SECTORS 40
+#define MIFARE_CLASSIC_TRAILER_GROUP 3 // Access condition group of a sector trailer
+#define MIFARE_KEY_SIZE 6
+
+// Decoded Classic access conditions: bit (field) allows key A, bit (field + 1) key B
+#define ACCESS_DATA_READ(group) ((group) * 4)
+#define ACCESS_DATA_WRITE(group) ((group) * 4 + 2)
+#define ACCESS_KEY_A_WRITE 12
+#define ACCESS_BITS_READ 14
+#define ACCESS_BITS_WRITE 16
+#define ACCESS_KEY_B_READ 18
+#define ACCESS_KEY_B_WRITE 20
+#define ACCESS_KEY_B_MASK 0x002AAAAA
+#define ACCESS_TRANSPORT 0x00155555 // FF 07 80: everything with key A only
+
+// Ultralight / NTAG2xx geometry: 4-byte pages, READ returns four of them
+#define NTAG_PAGE_SIZE 4
+#define NTAG_READ_PAGES 4
+#define NTAG_FIRST_WRITABLE_PAGE 2 // Pages 0-1 hold the UID
+#define NTAG_OTP_PAGES 4           // Lock bytes (page 2) and capability container (page 3)
+#define NTAG_VERSION_SIZE 8
+
+// Most pages a FAST_READ can return in one response
+#define NTAG_FAST_READ_MAX_PAGES ((PN532_MAX_FRAME_DATA - 2) / NTAG_PAGE_SIZE)
+
+// Most blocks a batched (vendor) MIFARE_READ can return in one response
+#define MIFARE_READ_MAX_BLOCKS ((PN532_MAX_FRAME_DATA - 2) / MIFARE_CLASSIC_BLOCK_SIZE)
+
+// AES-128 for WRITE_SECTOR key diversification (AES-CMAC, RFC 4493)
+#define AES_BLOCK_SIZE 16
+#define AES_ROUNDS 10
+#define AES_ROUND_KEYS_SIZE (AES_BLOCK_SIZE * (AES_ROUNDS + 1))
+#define KEY_DIVERSIFICATION_CONSTANT 0x01 // First byte of the diversification input
 
 typedef struct {
   uint8_t state;
   uint8_t uid[7];
   uint8_t uid_length;
   uint8_t card_type;
-  uint8_t memory[MIFARE_1K_SIZE]; // Memory contents for Mifare Classic 1K
+  uint8_t *image; // Base image loaded from a dump (NULL = factory image), read-only once loaded
+  uint8_t **chunks; // Per-chunk private copies (NULL = base image), allocated on first write
+  uint32_t *access; // Decoded Classic access conditions per sector (NULL = transport configuration)
+  int16_t *block_sums; // Byte sum of each CARD_SUM_BLOCK_SIZE block (-1 = stale), NULL until first read
+  int8_t auth_sector; // Sector authenticated since the card was selected (-1 = none)
+  uint8_t auth_key_type; // MIFARE_CMD_AUTH_A or MIFARE_CMD_AUTH_B
+  uint8_t auth_key[MIFARE_KEY_SIZE];
 } virtual_card_t;
 
+// Frame parser state (one per chip instance)
+typedef struct {
+  uint8_t state;
+  uint16_t length;
+  uint8_t length_checksum;
+  uint16_t data_index;
+  uint8_t checksum;
+} frame_parser_t;
+
+// Performance counters (stats_period_ms attribute dumps them)
+typedef struct {
+  uint32_t bytes_in;        // Frame bytes from the host, any interface
+  uint32_t bytes_out;       // Status, ACK and response bytes to the host
+  uint32_t frames;          // Valid command frames
+  uint32_t checksum_errors; // Frames dropped on a length or data checksum
+  uint32_t attr_reads;
+  uint32_t commands[256];   // Per command code
+  uint32_t latency[STATS_LATENCY_BUCKETS]; // ACK to response, by power of two microseconds
+  uint64_t ack_ns;          // When the current command was ACKed
+} chip_stats_t;
+
+// Part of a response payload: card memory, or masked bytes kept further
+// along in response_data. Only valid until build_tx_frame() has run.
+typedef struct {
+  const uint8_t *data;
+  uint16_t length;
+  uint8_t sum; // Byte sum, for the frame's DCS
+} response_fragment_t;
+
+// A command frame waiting for the running command to finish
+typedef struct {
+  uint8_t data[PN532_MAX_FRAME_DATA]; // Command code and parameters
+  uint16_t length;
+} queued_command_t;
+
+// One command's output: the ACK followed by the framed response
+typedef struct {
+  uint8_t data[PN532_TX_BUFFER_SIZE];
+  uint16_t length;
+  bool ready;      // Processing time has elapsed, the response may follow the ACK
+  bool power_down; // PowerDown response: the chip sleeps once the host has read it
+} response_slot_t;
+
+// Next card presence timeline event
+typedef struct {
+  uint64_t time_ns;
+  uint8_t action;
+  uint8_t uid[7];
+  uint8_t uid_length;
+} timeline_event_t;
+
+// Initiator frames waiting for TgGetData
+typedef struct {
+  uint8_t data[PEER_RING_SIZE];
+  uint16_t head; // Offset of the oldest byte
+  uint16_t used;
+  uint16_t frame_length[PEER_RING_FRAMES];
+  bool frame_chained[PEER_RING_FRAMES]; // Continues in the next frame (MI)
+  uint8_t frame_head;
+  uint8_t frame_count;
+} peer_ring_t;
+
 typedef struct {
   pin_t pin_irq;
   pin_t pin_reset;
   pin_t pin_req;
+  pin_t pin_ss;
   
   uint32_t card1_button;
   uint32_t card2_button;
   uint32_t reset_button;
+  uint32_t card_index_attr[CARD_INDEX_CONTROLS];
+  uint32_t card_count_attr;
+  uint32_t card_dumps_attr;
+  uint32_t card_type_attr;
+  uint32_t timeline_attr;
+  uint32_t journal_attr;
+  uint32_t field_sample_attr;
+  uint32_t log_level_attr;
+  uint32_t timing_mode_attr;
+  uint32_t interface_attr;
+  uint32_t spi_lsb_first_attr;
+  uint32_t hsu_baud_attr;
+  uint32_t stats_period_attr;
+  uint32_t trace_attr;
+  
+  uint8_t log_level;
+  uint8_t timing_mode;
+  uint8_t interface;
+  uint32_t field_sample_us;
   
   i2c_dev_t i2c;
+  spi_dev_t spi;
+  uart_dev_t uart;
   timer_t timer;
+  timer_t field_timer;
+  timer_t poll_timer;
+  timer_t peer_timer;
+  timer_t timeline_timer;
+  timer_t stats_timer;
   
-  // Communication state
-  bool waiting_for_ack;
-  bool waiting_for_response;
+  // Communication state. Frames that arrive while a command runs wait in
+  // command_queue; every command's output takes the next response slot, and
+  // the host reads the slots in order.
+  frame_parser_t parser;
+  queued_command_t command_queue[PN532_COMMAND_QUEUE_DEPTH];
+  uint8_t command_queue_head;
+  uint8_t command_queue_count;
+  bool command_running; // The newest response slot belongs to the running command
   uint8_t command;
-  uint8_t command_data[64];
-  uint8_t command_length;
+  uint8_t command_data[PN532_MAX_FRAME_DATA];
+  uint16_t command_length;
+  
+  uint8_t response_data[PN532_MAX_FRAME_DATA];
+  uint16_t response_length; // Bytes of response_data, before the payload fragments
+  
+  // Response payload gathered straight into the response slot by build_tx_frame()
+  response_fragment_t response_fragments[RESPONSE_MAX_FRAGMENTS];
+  uint8_t response_fragment_count;
+  uint16_t response_payload_length;
   
-  uint8_t response_data[64];
-  uint8_t response_length;
+  // Outgoing bytes, built once per command
+  response_slot_t responses[PN532_RESPONSE_RING_DEPTH];
+  uint8_t response_head;  // Slot the host reads
+  uint8_t response_count; // Slots in use
+  uint16_t tx_index;        // Bytes of the head slot read so far
+  uint16_t tx_ready_length; // Bytes of the head slot the host may read right now
+  bool tx_slot_done;        // A slot was read in full; the next one starts with the next transaction
+  bool irq_asserted;
+  bool i2c_status_pending;  // Next I2C read byte is the status byte
+  uint32_t response_latency_ns; // Processing time of the current command
+  bool command_held;        // Response waits for a card (see hold_command)
+  bool command_rejected;    // Handler found a bad parameter: syntax error frame
+  bool poll_timed_out;      // Completing a held command whose time ran out
+  uint8_t passive_activation_retries; // RFConfiguration MxRtyPassiveActivation
+  
+  // SPI transport
+  uint8_t spi_buffer[PN532_TX_BUFFER_SIZE];
+  uint8_t spi_phase;
+  uint16_t spi_frame_bytes; // Frame bytes at the start of spi_buffer in a data read (0 = all filler)
+  bool spi_selected;
+  bool spi_lsb_first;
+  
+  // HSU transport
+  uint8_t hsu_buffer[PN532_TX_BUFFER_SIZE];
+  bool hsu_writing;
   
   // Card simulation
-  virtual_card_t cards[MAX_VIRTUAL_CARDS];
-  int active_card_index;
+  virtual_card_t *cards;
+  uint16_t card_count;
+  uint16_t card_capacity;
+  uint16_t *uid_index; // Open-addressing UID hash table of card index + 1
+  uint32_t uid_index_mask;
+  int16_t field_cards[MAX_FIELD_CARDS]; // Cards in the RF field
+  uint8_t field_count;
+  int16_t targets[PN532_MAX_TARGETS]; // Card of each Tg - 1 (-1 = released or left the field)
+  uint8_t target_count;
+  uint8_t current_target; // Tg used by InCommunicateThru
+  uint32_t selected_card[CARD_INDEX_CONTROLS]; // Last card_index attribute values seen
+  uint8_t default_card_type; // Type of cards without a dump
+  
+  bool in_reset; // RST held low
+  
+  // PowerDown
+  bool powered_down;
+  uint8_t wakeup_enable;   // WAKEUP_* sources
+  bool wakeup_generate_irq;
+  bool wakeup_irq;         // IRQ asserted for a wakeup until the host's next transaction
+  
+  // Card presence timeline
+  FILE *timeline; // NULL once every event has been read
+  timeline_event_t timeline_event;
+  
+  // Target mode
+  uint8_t target_mode;
+  FILE *peer; // Initiator script, NULL once it has ended
+  peer_ring_t peer_ring;
+  bool peer_waiting; // Script waits for TgSetData
+  bool peer_delayed; // Script is in a delay
+  uint8_t peer_expected[PN532_MAX_FRAME_DATA];
+  uint16_t peer_expected_length;
+  
+  // I2C protocol trace: the current transaction is buffered until it ends
+  FILE *trace;
+  uint8_t trace_kind;
+  uint16_t trace_length;
+  uint64_t trace_start_ns; // Start of the current transaction
+  uint64_t trace_last_ns;  // Start of the previous record
+  uint8_t trace_buffer[TRACE_MAX_RECORD];
+  
+  // Card write journal
+  FILE *journal;
+  uint32_t journal_records;    // Records in the journal file
+  uint32_t journal_compact_at; // Record count that triggers the next compaction
   
-  // Card last command
-  uint8_t last_command;
-  uint8_t last_sector;
-  uint8_t last_block;
+  uint8_t factory_chunk[CARD_CHUNK_SIZE]; // Scratch for factory chunks that hold the UID
+  
+  // WRITE_SECTOR key diversification master key, kept expanded
+  uint8_t master_round_keys[AES_ROUND_KEYS_SIZE];
+  bool master_key_loaded;
+  
+  chip_stats_t stats;
 } chip_state_t;
 
+// Command dispatch table entries
+typedef struct {
+  void (*handler)(chip_state_t *chip);
+  uint8_t min_length;
+  uint32_t latency_ns;
+} command_entry_t;
+
+typedef struct {
+  void (*handler)(chip_state_t *chip, virtual_card_t *card, const uint8_t *data, uint16_t length);
+  uint8_t min_length;
+  uint32_t latency_ns;
+} mifare_command_entry_t;
+
+// Per card type geometry and operations. Card commands dispatch through the
+// type's command table, so each command handler serves a single card family.
+typedef struct {
+  const char *name;
+  uint16_t memory_size;    // Bytes of card memory
+  uint16_t block_count;    // Classic blocks or Ultralight / NTAG pages
+  uint8_t sector_count;    // Classic sectors (0 for page-based cards)
+  uint8_t uid_length;
+  uint8_t atqa[2];         // SENS_RES reported by InListPassiveTarget
+  uint8_t sak;             // SEL_RES
+  uint8_t cc_size;         // Capability container data area size (page-based cards)
+  const uint8_t *version;  // GET_VERSION response (NULL = not supported)
+  const mifare_command_entry_t *commands;
+  const uint8_t *(*factory_chunk)(chip_state_t *chip, virtual_card_t *card, int chunk);
+  void (*image_loaded)(chip_state_t *chip, virtual_card_t *card); // Take the UID (and access bits) from a dump
+} card_type_t;
+
+static const mifare_command_entry_t classic_command_table[256];
+static const mifare_command_entry_t ntag_command_table[256];
+static const card_type_t card_types[CARD_TYPE_COUNT];
+
 // Function prototypes
+static void init_i2c_interface(chip_state_t *chip);
+static void init_spi_interface(chip_state_t *chip);
+static void init_hsu_interface(chip_state_t *chip);
 static bool on_i2c_connect(void *user_data, uint32_t address, bool read);
 static uint8_t on_i2c_read(void *user_data);
 static bool on_i2c_write(void *user_data, uint8_t data);
 static void on_i2c_disconnect(void *user_data);
+static uint8_t i2c_read_byte(chip_state_t *chip);
+static void open_trace(chip_state_t *chip);
+static void trace_begin(chip_state_t *chip, uint8_t kind);
+static void trace_byte(chip_state_t *chip, uint8_t data);
+static void trace_end(chip_state_t *chip);
+static void trace_varint(FILE *file, uint64_t value);
+static void on_spi_ss_change(void *user_data, pin_t pin, uint32_t value);
+static void on_spi_done(void *user_data, uint8_t *buffer, uint32_t count);
+static void spi_start_data_read(chip_state_t *chip);
+static void spi_continue(chip_state_t *chip, uint32_t count);
+static uint8_t spi_byte(chip_state_t *chip, uint8_t value);
+static void on_hsu_rx_data(void *user_data, uint8_t byte);
+static void on_hsu_write_done(void *user_data);
+static void hsu_flush(chip_state_t *chip);
+static void frame_parser_feed(chip_state_t *chip, uint8_t data);
+static void frame_parser_start_data(frame_parser_t *parser);
 static void on_timer(void *user_data);
+static void tx_consume(chip_state_t *chip, uint32_t count);
+static void start_response(chip_state_t *chip);
+static void finish_processing(chip_state_t *chip);
+static void queue_command(chip_state_t *chip);
+static void run_next_command(chip_state_t *chip);
+static void abort_commands(chip_state_t *chip);
+static void resend_response(chip_state_t *chip);
+static response_slot_t *head_response(chip_state_t *chip);
+static response_slot_t *running_response(chip_state_t *chip);
+static void hold_command(chip_state_t *chip, uint64_t timeout_ns);
+static void cancel_held_command(chip_state_t *chip);
+static void complete_held_command(chip_state_t *chip, bool timed_out);
+static void on_poll_timer(void *user_data);
+static void start_peer(chip_state_t *chip);
+static void peer_advance(chip_state_t *chip);
+static void on_peer_timer(void *user_data);
+static bool peer_finished(chip_state_t *chip);
+static void peer_ring_push(chip_state_t *chip, const uint8_t *frame, int length, bool chained);
+static int peer_ring_pop(chip_state_t *chip, uint8_t *dest, bool *more);
+static int parse_hex(const char *text, uint8_t *data, int max_length);
+static void update_irq(chip_state_t *chip);
+static void notify_host(chip_state_t *chip);
+static void on_field_timer(void *user_data);
+static void tx_advance(chip_state_t *chip);
+static bool host_wakeup(chip_state_t *chip, uint8_t source);
+static void enter_power_down(chip_state_t *chip);
+static void wake_up(chip_state_t *chip, const char *source);
+static void on_req_change(void *user_data, pin_t pin, uint32_t value);
+static void on_reset_change(void *user_data, pin_t pin, uint32_t value);
+static void reset_chip(chip_state_t *chip);
+static void reset_card_memory(chip_state_t *chip, virtual_card_t *card);
+static void sample_card_field(chip_state_t *chip);
 static void process_command(chip_state_t *chip);
-static bool authenticate_sector(chip_state_t *chip, int card_index, int sector, uint8_t *key);
-static void initialize_virtual_card(virtual_card_t *card, int card_number);
+static void build_tx_frame(chip_state_t *chip);
+static void build_error_frame(chip_state_t *chip);
+static void card_exchange(chip_state_t *chip, virtual_card_t *card, const uint8_t *data, uint16_t length);
+static virtual_card_t *target_card(chip_state_t *chip, uint8_t tg);
+static void select_targets(chip_state_t *chip, uint8_t max_targets);
+static int write_target_data(chip_state_t *chip, uint8_t tg, uint8_t *data);
+static bool authenticate_sector(chip_state_t *chip, virtual_card_t *card, int sector,
+                                uint8_t key_type, const uint8_t *key);
+static bool mifare_write_trailer(chip_state_t *chip, virtual_card_t *card, int sector,
+                                 bool key_b, const uint8_t *data);
+static void diversify_key(const uint8_t *round_keys, virtual_card_t *card, int sector, uint8_t key_type, uint8_t *key);
+static void aes128_expand_key(const uint8_t *key, uint8_t *round_keys);
+static void aes128_encrypt(const uint8_t *round_keys, const uint8_t *in, uint8_t *out);
+static void aes_cmac(const uint8_t *round_keys, const uint8_t *message, int length, uint8_t *mac);
+static void cmac_subkey(const uint8_t *in, uint8_t *out);
+static uint8_t aes_xtime(uint8_t value);
+static bool decode_access_bits(const uint8_t *bits, uint32_t *access);
+static bool access_allows(uint32_t access, int field, bool key_b);
+static uint32_t card_access(const virtual_card_t *card, int sector);
+static void update_sector_access(chip_state_t *chip, virtual_card_t *card, int sector);
+static int classic_block_group(int block);
+static void init_card_registry(chip_state_t *chip);
+static void initialize_virtual_card(chip_state_t *chip, virtual_card_t *card, int index);
+static const card_type_t *card_type_of(const virtual_card_t *card);
+static int card_chunk_count(const virtual_card_t *card);
+static const uint8_t *card_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset);
+static const uint8_t *card_base_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset);
+static uint8_t *card_data_for_write(chip_state_t *chip, virtual_card_t *card, uint32_t offset);
+static void respond_card_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset, uint32_t length);
+static void respond_bytes(chip_state_t *chip, const uint8_t *data, uint16_t length, uint8_t sum);
+static uint8_t card_block_sum(chip_state_t *chip, virtual_card_t *card, int block);
+static uint8_t byte_sum(const uint8_t *data, uint16_t length);
+static const uint8_t *classic_factory_chunk(chip_state_t *chip, virtual_card_t *card, int chunk);
+static const uint8_t *ntag_factory_chunk(chip_state_t *chip, virtual_card_t *card, int chunk);
+static void classic_image_loaded(chip_state_t *chip, virtual_card_t *card);
+static void ntag_image_loaded(chip_state_t *chip, virtual_card_t *card);
+static int classic_sector(int block);
+static int classic_sector_trailer(int sector);
+static void ntag_write_page(chip_state_t *chip, virtual_card_t *card, int page, const uint8_t *bytes);
+static int add_card(chip_state_t *chip);
+static void build_uid_index(chip_state_t *chip);
+static void load_card_dumps(chip_state_t *chip);
+static int load_card_pack(chip_state_t *chip, FILE *file);
+static bool load_raw_dump(chip_state_t *chip, int index, FILE *file);
+static bool load_eml_dump(chip_state_t *chip, int index, FILE *file);
+static uint8_t *card_image_new(long size, int *type);
+static void card_image_install(chip_state_t *chip, int index, int type, uint8_t *image);
+static bool register_card_uid(chip_state_t *chip, int index);
+static int find_card_by_uid(chip_state_t *chip, const uint8_t *uid, uint8_t uid_length);
+static void field_changed(chip_state_t *chip);
+static void place_card(chip_state_t *chip, int index);
+static void remove_card(chip_state_t *chip, int index);
+static void clear_card_field(chip_state_t *chip);
+static bool anticollision_wins(const virtual_card_t *a, const virtual_card_t *b);
+static int cascade_uid(const virtual_card_t *card, uint8_t *bytes);
+static uint32_t read_attr(chip_state_t *chip, uint32_t attr);
+static void set_response_ready(chip_state_t *chip);
+#if PN532_STATS
+static void stats_record_latency(chip_state_t *chip, uint64_t latency_ns);
+#endif
+static void on_stats_timer(void *user_data);
+static void dump_stats(chip_state_t *chip);
+static void open_timeline(chip_state_t *chip);
+static void on_timeline_timer(void *user_data);
+static void schedule_timeline_event(chip_state_t *chip);
+static bool read_timeline_event(chip_state_t *chip);
+static void apply_timeline_event(chip_state_t *chip);
+static int add_card_with_uid(chip_state_t *chip, const uint8_t *uid, uint8_t uid_length);
+static void open_journal(chip_state_t *chip);
+static uint32_t replay_journal(chip_state_t *chip, FILE *file);
+static void journal_append(chip_state_t *chip, virtual_card_t *card, int block);
+static void compact_journal(chip_state_t *chip);
+static uint32_t write_journal_records(chip_state_t *chip, FILE *file);
+static void write_journal_record(FILE *file, virtual_card_t *card, int block, const uint8_t *data);
 
 // Utility function to convert a hex value to ASCII for printing
 static char hexchar(uint8_t val) {
@@ -105,32 +724,63 @@ static char hexchar(uint8_t val) {
   return 'A' + (val - 10);
 }
 
+// Format bytes as "AA BB CC" for a single log call (text must hold 3 * length bytes)
+static const char *format_hex(char *text, const uint8_t *data, int length) {
+  text[0] = '\0';
+  for (int i = 0; i < length; i++) {
+    text[i * 3] = hexchar(data[i] >> 4);
+    text[i * 3 + 1] = hexchar(data[i] & 0x0F);
+    text[i * 3 + 2] = (i + 1 < length) ? ' ' : '\0';
+  }
+  return text;
+}
+
 void chip_init() {
   chip_state_t *chip = malloc(sizeof(chip_state_t));
   memset(chip, 0, sizeof(chip_state_t));
   
+  // Runtime log level, capped by what was compiled in
+  chip->log_level_attr = attr_init("log_level", PN532_LOG_LEVEL);
+  chip->log_level = read_attr(chip, chip->log_level_attr);
+  
   // Initialize pins
   chip->pin_irq = pin_init("IRQ", OUTPUT_HIGH);
-  chip->pin_reset = pin_init("RST", INPUT);
-  chip->pin_req = pin_init("REQ", INPUT); // Hardware request pin
+  chip->pin_reset = pin_init("RST", INPUT_PULLUP); // Pulled up on the breakout board
+  chip->pin_req = pin_init("REQ", INPUT); // Hardware request pin, wakes the chip from PowerDown
   
   // Initialize attributes
   chip->card1_button = attr_init("card1", 0);
   chip->card2_button = attr_init("card2", 0);
   chip->reset_button = attr_init("reset", 0);
+  chip->card_index_attr[0] = attr_init("card_index", 0);
+  chip->card_index_attr[1] = attr_init("card_index2", 0);
+  chip->card_count_attr = attr_init("card_count", DEFAULT_CARD_COUNT);
+  chip->card_dumps_attr = attr_init("card_dumps", 0);
+  chip->card_type_attr = attr_init("card_type", CARD_TYPE_MIFARE_CLASSIC);
+  chip->timeline_attr = attr_init("timeline", 0);
+  chip->journal_attr = attr_init("journal", 0);
+  chip->field_sample_attr = attr_init("field_sample_us", DEFAULT_FIELD_SAMPLE_US);
+  chip->timing_mode_attr = attr_init("timing_mode", TIMING_MODE_REALISTIC);
+  chip->timing_mode = read_attr(chip, chip->timing_mode_attr);
   
-  // Initialize I2C interface
-  const i2c_config_t i2c_config = {
-    .user_data = chip,
-    .address = PN532_I2C_ADDRESS,
-    .scl = pin_init("SCL", INPUT_PULLUP),
-    .sda = pin_init("SDA", INPUT_PULLUP),
-    .connect = on_i2c_connect,
-    .read = on_i2c_read,
-    .write = on_i2c_write,
-    .disconnect = on_i2c_disconnect,
-  };
-  chip->i2c = i2c_init(&i2c_config);
+  chip->interface_attr = attr_init("interface", INTERFACE_I2C);
+  chip->spi_lsb_first_attr = attr_init("spi_lsb_first", 1);
+  chip->hsu_baud_attr = attr_init("hsu_baud", DEFAULT_HSU_BAUD_RATE);
+  chip->stats_period_attr = attr_init("stats_period_ms", 0);
+  chip->trace_attr = attr_init("trace", 0);
+  
+  // Initialize the host interface
+  chip->interface = read_attr(chip, chip->interface_attr);
+  if (chip->interface == INTERFACE_SPI) {
+    init_spi_interface(chip);
+  } else if (chip->interface == INTERFACE_HSU) {
+    init_hsu_interface(chip);
+  } else {
+    init_i2c_interface(chip);
+    if (read_attr(chip, chip->trace_attr)) {
+      open_trace(chip);
+    }
+  }
   
   // Initialize timer
   const timer_config_t timer_config = {
@@ -139,482 +789,3189 @@ void chip_init() {
   };
   chip->timer = timer_init(&timer_config);
   
+  // Initialize card field sampling timer
+  const timer_config_t field_timer_config = {
+    .callback = on_field_timer,
+    .user_data = chip,
+  };
+  chip->field_timer = timer_init(&field_timer_config);
+  
+  // Initialize the timer that ends held polling commands
+  const timer_config_t poll_timer_config = {
+    .callback = on_poll_timer,
+    .user_data = chip,
+  };
+  chip->poll_timer = timer_init(&poll_timer_config);
+  
+  // Initialize the target mode initiator script timer
+  const timer_config_t peer_timer_config = {
+    .callback = on_peer_timer,
+    .user_data = chip,
+  };
+  chip->peer_timer = timer_init(&peer_timer_config);
+  
+  // Initialize the card presence timeline timer
+  const timer_config_t timeline_timer_config = {
+    .callback = on_timeline_timer,
+    .user_data = chip,
+  };
+  chip->timeline_timer = timer_init(&timeline_timer_config);
+  
+  // Initialize the statistics dump timer
+  const timer_config_t stats_timer_config = {
+    .callback = on_stats_timer,
+    .user_data = chip,
+  };
+  chip->stats_timer = timer_init(&stats_timer_config);
+  uint32_t stats_period_ms = read_attr(chip, chip->stats_period_attr);
+  if (PN532_STATS && stats_period_ms > 0) {
+    timer_start(chip->stats_timer, stats_period_ms * 1000, true);
+  }
+  
+  chip->passive_activation_retries = PN532_RETRIES_FOREVER;
+  
+  // Hardware reset: edges only, so an idle RST costs nothing
+  const pin_watch_config_t reset_watch_config = {
+    .user_data = chip,
+    .edge = BOTH,
+    .pin_change = on_reset_change,
+  };
+  pin_watch(chip->pin_reset, &reset_watch_config);
+  
   // Initialize virtual cards
-  for (int i = 0; i < MAX_VIRTUAL_CARDS; i++) {
-    initialize_virtual_card(&chip->cards[i], i + 1);
+  init_card_registry(chip);
+  if (read_attr(chip, chip->timeline_attr)) {
+    open_timeline(chip);
   }
   
-  // Set to no active card initially
-  chip->active_card_index = -1;
+  // Sample the card buttons periodically instead of on every I2C byte
+  chip->field_sample_us = read_attr(chip, chip->field_sample_attr);
+  sample_card_field(chip);
+  if (chip->field_sample_us > 0) {
+    timer_start(chip->field_timer, chip->field_sample_us, true);
+  }
   
-  printf("PN532 NFC/RFID Custom Chip initialized\n");
+  LOG_INFO(chip, "PN532 NFC/RFID Custom Chip initialized\n");
 }
 
-static void initialize_virtual_card(virtual_card_t *card, int card_number) {
-  card->state = CARD_STATE_ABSENT;
-  card->card_type = CARD_TYPE_MIFARE_CLASSIC;
-  card->uid_length = UID_SIZE_MIFARE_CLASSIC;
+// Card registry: one compact descriptor per card, memory allocated on
+// first use and a UID hash index for lookups.
+
+static void init_card_registry(chip_state_t *chip) {
+  uint32_t count = read_attr(chip, chip->card_count_attr);
   
-  // Generate a unique UID for each card
-  if (card_number == 1) {
-    // Card 1 UID: DE AD BE EF
-    card->uid[0] = 0xDE;
-    card->uid[1] = 0xAD;
-    card->uid[2] = 0xBE;
-    card->uid[3] = 0xEF;
-    printf("Card 1 UID: DE AD BE EF\n");
-  } else {
-    // Card 2 UID: CA FE BA BE
-    card->uid[0] = 0xCA;
-    card->uid[1] = 0xFE;
-    card->uid[2] = 0xBA;
-    card->uid[3] = 0xBE;
-    printf("Card 2 UID: CA FE BA BE\n");
+  if (count < DEFAULT_CARD_COUNT) {
+    count = DEFAULT_CARD_COUNT; // card1/card2 buttons always have a card
+  } else if (count > MAX_CARD_COUNT) {
+    count = MAX_CARD_COUNT;
+  }
+  
+  chip->default_card_type = read_attr(chip, chip->card_type_attr);
+  if (chip->default_card_type >= CARD_TYPE_COUNT) {
+    LOG_ERROR(chip, "Unknown card type %u, using %s\n", chip->default_card_type,
+              card_types[CARD_TYPE_MIFARE_CLASSIC].name);
+    chip->default_card_type = CARD_TYPE_MIFARE_CLASSIC;
   }
   
-  // Initialize card memory
-  memset(card->memory, 0, MIFARE_1K_SIZE);
+  chip->cards = calloc(count, sizeof(virtual_card_t));
+  chip->card_capacity = count;
+  for (uint32_t i = 0; i < count; i++) {
+    initialize_virtual_card(chip, &chip->cards[i], i);
+  }
+  chip->card_count = count;
   
-  // Default card memory initialization:
-  // Manufacturer block (block 0)
-  memcpy(card->memory, card->uid, 4);
+  if (read_attr(chip, chip->card_dumps_attr)) {
+    load_card_dumps(chip);
+  }
   
-  // Set up all sector trailers (every 4th block) with default keys
-  for (int sector = 0; sector < MIFARE_CLASSIC_SECTOR_COUNT; sector++) {
-    int block = sector * MIFARE_CLASSIC_BLOCKS_PER_SECTOR + (MIFARE_CLASSIC_BLOCKS_PER_SECTOR - 1);
-    int offset = block * MIFARE_CLASSIC_BLOCK_SIZE;
-    
-    // Key A - Default 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF
-    for (int i = 0; i < 6; i++) {
-      card->memory[offset + i] = 0xFF;
-    }
-    
-    // Access bits - Default permissions
-    card->memory[offset + 6] = 0xFF;
-    card->memory[offset + 7] = 0x07;
-    card->memory[offset + 8] = 0x80;
-    card->memory[offset + 9] = 0x69;
-    
-    // Key B - Default 0xFF 0xFF 0xFF 0xFF 0xFF 0xFF
-    for (int i = 10; i < 16; i++) {
-      card->memory[offset + i] = 0xFF;
-    }
+  build_uid_index(chip);
+  
+  if (read_attr(chip, chip->journal_attr)) {
+    open_journal(chip);
   }
+  
+  LOG_INFO(chip, "Card registry: %u cards\n", chip->card_count);
 }
 
-static bool on_i2c_connect(void *user_data, uint32_t address, bool read) {
-  return true; // Always ACK
+// Append a card with a generated UID, growing the descriptor array
+static int add_card(chip_state_t *chip) {
+  if (chip->card_count == chip->card_capacity) {
+    chip->card_capacity *= 2;
+    chip->cards = realloc(chip->cards, chip->card_capacity * sizeof(virtual_card_t));
+  }
+  initialize_virtual_card(chip, &chip->cards[chip->card_count], chip->card_count);
+  return chip->card_count++;
 }
 
-static uint8_t on_i2c_read(void *user_data) {
-  chip_state_t *chip = (chip_state_t *)user_data;
-  
-  // Check attribute values for virtual card simulation
-  uint32_t card1_state = attr_read(chip->card1_button);
-  uint32_t card2_state = attr_read(chip->card2_button);
-  uint32_t reset_state = attr_read(chip->reset_button);
+static void build_uid_index(chip_state_t *chip) {
+  uint32_t size = 1;
   
-  // Handle reset button
-  if (reset_state) {
-    chip->active_card_index = -1;
-    chip->cards[0].state = CARD_STATE_ABSENT;
-    chip->cards[1].state = CARD_STATE_ABSENT;
-    printf("Card field reset - all cards removed\n");
+  while (size < chip->card_count * 2u) {
+    size <<= 1;
   }
+  free(chip->uid_index);
+  chip->uid_index = calloc(size, sizeof(uint16_t));
+  chip->uid_index_mask = size - 1;
   
-  // Update card 1 state
-  if (card1_state && chip->cards[0].state == CARD_STATE_ABSENT) {
-    chip->cards[0].state = CARD_STATE_PRESENT;
-    chip->active_card_index = 0;
-    chip->cards[1].state = CARD_STATE_ABSENT; // Only one card active at a time
-    printf("Card 1 placed in field\n");
+  for (int i = 0; i < chip->card_count; i++) {
+    if (!register_card_uid(chip, i)) {
+      LOG_ERROR(chip, "Card %d has a duplicate UID\n", i + 1);
+    }
   }
+}
+
+// Card dump loading (card_dumps attribute). A pack file holds many raw
+// images for cards 1, 2, ...; card<N>.mfd / .bin / .eml then replace the
+// contents of card N for every card in the registry.
+// Raw images are read with one fread into a fresh base image, which only
+// replaces the card's once it is complete.
+
+static void load_card_dumps(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  int loaded = 0;
+  FILE *file;
   
-  // Update card 2 state
-  if (card2_state && chip->cards[1].state == CARD_STATE_ABSENT) {
-    chip->cards[1].state = CARD_STATE_PRESENT;
-    chip->active_card_index = 1;
-    chip->cards[0].state = CARD_STATE_ABSENT; // Only one card active at a time
-    printf("Card 2 placed in field\n");
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_CARD_PACK_FILE);
+  file = fopen(path, "rb");
+  if (file != NULL) {
+    loaded += load_card_pack(chip, file);
+    fclose(file);
   }
   
-  // If waiting for ACK, send ACK packet
-  if (chip->waiting_for_ack) {
-    static uint8_t ack_index = 0;
-    static const uint8_t ack_packet[] = PN532_ACK_PACKET;
+  for (int n = 1; n <= chip->card_count; n++) {
+    bool found = false;
     
-    uint8_t byte = ack_packet[ack_index++];
-    
-    if (ack_index >= PN532_ACK_PACKET_SIZE) {
-      ack_index = 0;
-      chip->waiting_for_ack = false;
-      
-      // Process the command after sending the ACK
-      process_command(chip);
+    snprintf(path, sizeof(path), "%scard%d.mfd", PN532_DUMP_DIR, n);
+    if ((file = fopen(path, "rb")) == NULL) {
+      snprintf(path, sizeof(path), "%scard%d.bin", PN532_DUMP_DIR, n);
+      file = fopen(path, "rb");
     }
-    
-    return byte;
-  }
-  
-  // If waiting for response, send response packet
-  if (chip->waiting_for_response) {
-    static uint8_t response_index = 0;
-    
-    // First time starting response, send header
-    if (response_index == 0) {
-      response_index++;
-      return PN532_PREAMBLE;
-    } else if (response_index == 1) {
-      response_index++;
-      return PN532_STARTCODE1;
-    } else if (response_index == 2) {
-      response_index++;
-      return PN532_STARTCODE2;
-    } else if (response_index == 3) {
-      response_index++;
-      return chip->response_length + 1; // Length (TFI + response data)
-    } else if (response_index == 4) {
-      response_index++;
-      // Length checksum
-      return ~(chip->response_length + 1) + 1;
-    } else if (response_index == 5) {
-      response_index++;
-      return PN532_PN532TOHOST; // TFI
-    } else if (response_index >= 6 && response_index < 6 + chip->response_length) {
-      return chip->response_data[response_index++ - 6];
-    } else if (response_index == 6 + chip->response_length) {
-      // Calculate checksum
-      uint8_t sum = PN532_PN532TOHOST;
-      for (int i = 0; i < chip->response_length; i++) {
-        sum += chip->response_data[i];
+    if (file != NULL) {
+      found = load_raw_dump(chip, n - 1, file);
+      fclose(file);
+    } else {
+      snprintf(path, sizeof(path), "%scard%d.eml", PN532_DUMP_DIR, n);
+      if ((file = fopen(path, "r")) != NULL) {
+        found = load_eml_dump(chip, n - 1, file);
+        fclose(file);
       }
-      response_index++;
-      return ~sum + 1;
-    } else if (response_index == 7 + chip->response_length) {
-      response_index = 0;
-      chip->waiting_for_response = false;
-      return PN532_POSTAMBLE;
+    }
+    if (found) {
+      loaded++;
     }
   }
   
-  // Default READY byte (for when not sending a specific response)
-  return 0x01;
+  if (loaded > 0) {
+    LOG_INFO(chip, "Loaded %d card dump(s)\n", loaded);
+  }
 }
 
-static bool on_i2c_write(void *user_data, uint8_t data) {
-  chip_state_t *chip = (chip_state_t *)user_data;
+// Pack file: the PN532_CARD_PACK_MAGIC magic (4 bytes), then for each card a
+// little-endian uint16 image size followed by the raw image
+static int load_card_pack(chip_state_t *chip, FILE *file) {
+  uint8_t magic[4];
+  uint8_t size_bytes[2];
+  int index = 0;
   
-  static uint8_t frame_state = 0;
-  static uint8_t frame_length = 0;
-  static uint8_t frame_length_checksum = 0;
-  static uint8_t frame_data_index = 0;
-  static uint8_t frame_checksum = 0;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, PN532_CARD_PACK_MAGIC, sizeof(magic)) != 0) {
+    LOG_ERROR(chip, "Card pack file has a bad header\n");
+    return 0;
+  }
   
-  // State machine for I2C write frame processing
-  switch (frame_state) {
-    case 0: // Preamble
-      if (data == PN532_PREAMBLE) {
-        frame_state = 1;
-      }
-      break;
-    
-    case 1: // Start code 1
-      if (data == PN532_STARTCODE1) {
-        frame_state = 2;
-      } else {
-        frame_state = 0; // Reset
-      }
-      break;
-    
-    case 2: // Start code 2
-      if (data == PN532_STARTCODE2) {
-        frame_state = 3;
-      } else {
-        frame_state = 0; // Reset
-      }
-      break;
-    
-    case 3: // Length
-      frame_length = data;
-      frame_state = 4;
-      break;
-    
-    case 4: // Length checksum
-      frame_length_checksum = data;
-      if ((frame_length + frame_length_checksum) & 0xFF) {
-        // Length checksum error
-        frame_state = 0;
-      } else {
-        frame_state = 5;
-        frame_data_index = 0;
-        frame_checksum = 0;
-      }
-      break;
-    
-    case 5: // TFI (Host to PN532)
-      if (data == PN532_HOSTTOPN532) {
-        frame_state = 6;
-        frame_checksum = data;
-      } else {
-        frame_state = 0; // Reset
-      }
-      break;
-    
-    case 6: // Command byte
-      chip->command = data;
-      chip->command_data[0] = data;
-      frame_data_index = 1;
-      frame_checksum += data;
-      frame_state = 7;
-      break;
-    
-    case 7: // Command data
-      if (frame_data_index < frame_length - 1) { // -1 because we already got command byte
-        chip->command_data[frame_data_index] = data;
-        frame_checksum += data;
-        frame_data_index++;
-      } else {
-        // This should be the checksum
-        if ((frame_checksum + data) & 0xFF) {
-          // Checksum error
-          frame_state = 0;
-        } else {
-          frame_state = 8;
-        }
-      }
-      break;
+  while (index < MAX_CARD_COUNT && fread(size_bytes, 1, 2, file) == 2) {
+    uint16_t size = size_bytes[0] | size_bytes[1] << 8;
+    int type;
+    uint8_t *image = card_image_new(size, &type);
     
-    case 8: // Postamble
-      if (data == PN532_POSTAMBLE) {
-        // Valid frame received, set length and prepare to ACK
-        chip->command_length = frame_length - 1; // -1 because we don't include TFI
-        chip->waiting_for_ack = true;
-        
-        // Start a timer to simulate processing time
-        timer_start(chip->timer, 1000, false); // 1ms delay
-      }
-      frame_state = 0; // Reset
+    if (image == NULL || fread(image, 1, size, file) != size) {
+      LOG_ERROR(chip, "Card pack entry %d is invalid\n", index + 1);
+      free(image); // A truncated entry leaves the card untouched
       break;
+    }
+    card_image_install(chip, index, type, image);
+    index++;
   }
-  
-  return true; // Always ACK
-}
-
-static void on_i2c_disconnect(void *user_data) {
-  // Nothing to do here
+  return index;
 }
 
-static void on_timer(void *user_data) {
-  chip_state_t *chip = (chip_state_t *)user_data;
+static bool load_raw_dump(chip_state_t *chip, int index, FILE *file) {
+  long size;
+  int type;
+  uint8_t *image;
   
-  // Set the IRQ pin low to indicate ready
-  pin_write(chip->pin_irq, LOW);
+  fseek(file, 0, SEEK_END);
+  size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  
+  image = card_image_new(size, &type);
+  if (image == NULL) {
+    LOG_ERROR(chip, "Card %d dump has an unsupported size (%ld bytes)\n", index + 1, size);
+    return false;
+  }
+  if (fread(image, 1, size, file) != (size_t)size) {
+    LOG_ERROR(chip, "Card %d dump could not be read\n", index + 1);
+    free(image);
+    return false;
+  }
+  card_image_install(chip, index, type, image);
+  return true;
 }
 
-static void process_command(chip_state_t *chip) {
-  printf("Processing command: 0x%02X\n", chip->command);
-  
-  // Set response frame parameters
-  chip->waiting_for_response = true;
-  
-  switch (chip->command) {
-    case PN532_COMMAND_GETFIRMWAREVERSION: {
-      chip->response_data[0] = PN532_RESPONSE_GETFIRMWAREVERSION;
-      chip->response_data[1] = 0x32; // IC version: PN532
-      chip->response_data[2] = 0x01; // Firmware version 1
-      chip->response_data[3] = 0x06; // Firmware revision 6
-      chip->response_data[4] = 0x07; // Various capabilities
-      chip->response_length = 5;
-      
-      printf("Responded with firmware version: PN532 v1.6\n");
-      break;
-    }
-    
-    case PN532_COMMAND_SAMCONFIGURATION: {
-      chip->response_data[0] = PN532_RESPONSE_SAMCONFIGURATION;
-      chip->response_data[1] = 0x00; // Status OK
-      chip->response_length = 2;
-      
-      printf("Configured SAM\n");
-      break;
-    }
-    
-    case PN532_COMMAND_INLISTPASSIVETARGET: {
-      uint8_t max_targets = chip->command_data[1];
-      uint8_t card_baud_rate = chip->command_data[2];
-      
-      chip->response_data[0] = PN532_RESPONSE_INLISTPASSIVETARGET;
-      
-      // Check if we have an active card
-      if (chip->active_card_index >= 0 && 
-          chip->cards[chip->active_card_index].state == CARD_STATE_PRESENT) {
-        
-        virtual_card_t *active_card = &chip->cards[chip->active_card_index];
-        
-        chip->response_data[1] = 0x01; // Number of targets found
-        chip->response_data[2] = 0x01; // Target number
-        
-        if (card_baud_rate == 0) { // Mifare cards (ISO/IEC 14443A)
-          chip->response_data[3] = 0x00; // Card ATQA MSB
-          chip->response_data[4] = 0x04; // Card ATQA LSB
-          chip->response_data[5] = active_card->uid_length; // UID length
-          
-          // Copy UID
-          for (int i = 0; i < active_card->uid_length; i++) {
-            chip->response_data[6 + i] = active_card->uid[i];
-          }
-          
-          // SAK byte after UID
-          chip->response_data[6 + active_card->uid_length] = 0x08; // Mifare Classic 1K
-          
-          chip->response_length = 7 + active_card->uid_length;
-          
-          printf("Card found - UID: ");
-          for (int i = 0; i < active_card->uid_length; i++) {
-            printf("%02X ", active_card->uid[i]);
-          }
-          printf("\n");
-        } else {
-          // Unsupported card type
-          chip->response_data[1] = 0x00; // No targets found
-          chip->response_length = 2;
-          printf("Unsupported card type requested\n");
-        }
-      } else {
-        // No card present
-        chip->response_data[1] = 0x00; // No targets found
-        chip->response_length = 2;
-        printf("No card found in field\n");
-      }
-      break;
+// Proxmark .eml: one block (or page) per line as hex digits
+static bool load_eml_dump(chip_state_t *chip, int index, FILE *file) {
+  uint8_t image[MAX_CARD_MEMORY_SIZE];
+  uint32_t size = 0;
+  int high = -1;
+  int c;
+  
+  while ((c = fgetc(file)) != EOF && size < sizeof(image)) {
+    int nibble;
+    if (c >= '0' && c <= '9') {
+      nibble = c - '0';
+    } else if (c >= 'A' && c <= 'F') {
+      nibble = c - 'A' + 10;
+    } else if (c >= 'a' && c <= 'f') {
+      nibble = c - 'a' + 10;
+    } else if (c == '-') {
+      nibble = 0; // Unknown byte in a partial dump
+    } else {
+      continue; // Line breaks and other separators
     }
-    
-    case PN532_COMMAND_INDATAEXCHANGE: {
-      uint8_t target_number = chip->command_data[1];
-      uint8_t mifare_command = chip->command_data[2];
-      
-      chip->response_data[0] = PN532_RESPONSE_INDATAEXCHANGE;
-      
-      // Make sure we have an active card
-      if (chip->active_card_index >= 0 && 
-          chip->cards[chip->active_card_index].state == CARD_STATE_PRESENT) {
-          
-        virtual_card_t *active_card = &chip->cards[chip->active_card_index];
-        
-        switch (mifare_command) {
-          case 0x60: // Auth A
-          case 0x61: { // Auth B
-            uint8_t block_number = chip->command_data[3];
-            uint8_t *key = &chip->command_data[4]; // 6-byte key
-            int sector = block_number / 4;
-            
-            chip->last_command = mifare_command;
-            chip->last_block = block_number;
-            chip->last_sector = sector;
-            
-            if (authenticate_sector(chip, chip->active_card_index, sector, key)) {
-              chip->response_data[1] = 0x00; // Authentication successful
-              printf("Authentication successful for sector %d\n", sector);
-            } else {
-              chip->response_data[1] = 0x01; // Authentication failed
-              printf("Authentication failed for sector %d\n", sector);
-            }
-            chip->response_length = 2;
-            break;
-          }
-          
-          case PN532_COMMAND_MIFARE_READ: {
-            uint8_t block_number = chip->command_data[3];
-            int sector = block_number / 4;
-            int block_offset = block_number * MIFARE_CLASSIC_BLOCK_SIZE;
-            
-            // Check authentication
-            if (sector == chip->last_sector) {
-              chip->response_data[1] = 0x00; // Status OK
-              
-              // Copy 16 bytes from card memory
-              for (int i = 0; i < MIFARE_CLASSIC_BLOCK_SIZE; i++) {
-                chip->response_data[2 + i] = active_card->memory[block_offset + i];
-              }
-              
-              chip->response_length = 2 + MIFARE_CLASSIC_BLOCK_SIZE;
-              
-              printf("Read block %d from sector %d\n", block_number, sector);
-            } else {
-              chip->response_data[1] = 0x01; // Authentication required
-              chip->response_length = 2;
-              printf("Authentication required for sector %d\n", sector);
-            }
-            break;
-          }
-          
-          case PN532_COMMAND_MIFARE_WRITE: {
-            uint8_t block_number = chip->command_data[3];
-            int sector = block_number / 4;
-            int block_offset = block_number * MIFARE_CLASSIC_BLOCK_SIZE;
-            
-            // Check authentication
-            if (sector == chip->last_sector) {
-              // Copy 16 bytes to card memory
-              for (int i = 0; i < MIFARE_CLASSIC_BLOCK_SIZE; i++) {
-                active_card->memory[block_offset + i] = chip->command_data[4 + i];
-              }
-              
-              chip->response_data[1] = 0x00; // Status OK
-              chip->response_length = 2;
-              
-              printf("Wrote block %d in sector %d\n", block_number, sector);
-            } else {
-              chip->response_data[1] = 0x01; // Authentication required
-              chip->response_length = 2;
-              printf("Authentication required for sector %d\n", sector);
-            }
-            break;
-          }
-          
-          default:
-            // Unsupported command
-            chip->response_data[1] = 0x01; // Error
-            chip->response_length = 2;
-            printf("Unsupported Mifare command: 0x%02X\n", mifare_command);
-            break;
-        }
-      } else {
-        // No card present
-        chip->response_data[1] = 0x01; // Error
-        chip->response_length = 2;
-        printf("No card in field for data exchange\n");
-      }
-      break;
+    if (high < 0) {
+      high = nibble;
+    } else {
+      image[size++] = high << 4 | nibble;
+      high = -1;
     }
-    
-    default:
-      // Unsupported command
-      printf("Unsupported command: 0x%02X\n", chip->command);
-      chip->waiting_for_response = false; // Don't send any response
-      break;
   }
+  
+  int type;
+  uint8_t *target = card_image_new(size, &type);
+  if (target == NULL) {
+    LOG_ERROR(chip, "Card %d .eml dump has an unsupported size (%u bytes)\n", index + 1, size);
+    return false;
+  }
+  memcpy(target, image, size);
+  card_image_install(chip, index, type, target);
+  return true;
 }
 
-static bool authenticate_sector(chip_state_t *chip, int card_index, int sector, uint8_t *key) {
-  if (card_index < 0 || card_index >= MAX_VIRTUAL_CARDS) {
-    return false;
+// Fresh zeroed base image for a dump of the given size, which selects the
+// card type; returns NULL for sizes that match no supported card
+static uint8_t *card_image_new(long size, int *type) {
+  *type = 0;
+  while (*type < CARD_TYPE_COUNT && card_types[*type].memory_size != size) {
+    (*type)++;
+  }
+  if (*type == CARD_TYPE_COUNT) {
+    return NULL;
+  }
+  // Whole chunks, so a chunk of the image can always be copied at once
+  return calloc((size + CARD_CHUNK_SIZE - 1) / CARD_CHUNK_SIZE, CARD_CHUNK_SIZE);
+}
+
+// Hand a complete image to card `index` (growing the registry if needed),
+// replacing its type and previous image
+static void card_image_install(chip_state_t *chip, int index, int type, uint8_t *image) {
+  virtual_card_t *card;
+  
+  while (index >= chip->card_count) {
+    add_card(chip);
   }
+  card = &chip->cards[index];
+  free(card->image);
+  card->image = image;
+  card->card_type = type;
   
-  if (sector < 0 || sector >= MIFARE_CLASSIC_SECTOR_COUNT) {
+  free(card->block_sums); // New contents, and maybe a new size
+  card->block_sums = NULL;
+  card_type_of(card)->image_loaded(chip, card);
+}
+
+static void initialize_virtual_card(chip_state_t *chip, virtual_card_t *card, int index) {
+  static const uint8_t card1_uid[] = {0xDE, 0xAD, 0xBE, 0xEF};
+  static const uint8_t card2_uid[] = {0xCA, 0xFE, 0xBA, 0xBE};
+  uint8_t uid[UID_SIZE_MIFARE_CLASSIC];
+  
+  card->state = CARD_STATE_ABSENT;
+  card->card_type = chip->default_card_type;
+  card->uid_length = card_type_of(card)->uid_length;
+  card->image = NULL;
+  card->chunks = NULL; // Reads come from the factory image until a write
+  card->access = NULL;
+  card->block_sums = NULL;
+  card->auth_sector = -1;
+  
+  // Cards 1 and 2 keep their well-known UIDs, the rest are derived from the index
+  if (index == 0) {
+    memcpy(uid, card1_uid, UID_SIZE_MIFARE_CLASSIC);
+  } else if (index == 1) {
+    memcpy(uid, card2_uid, UID_SIZE_MIFARE_CLASSIC);
+  } else {
+    uid[0] = GENERATED_UID_PREFIX;
+    uid[1] = (index >> 16) & 0xFF;
+    uid[2] = (index >> 8) & 0xFF;
+    uid[3] = index & 0xFF;
+  }
+  
+  // 7-byte UIDs get the NXP manufacturer byte in front
+  memset(card->uid, 0, sizeof(card->uid));
+  if (card->uid_length == UID_SIZE_NTAG) {
+    card->uid[0] = NXP_MANUFACTURER_ID;
+    memcpy(&card->uid[1], uid, UID_SIZE_MIFARE_CLASSIC);
+  } else {
+    memcpy(card->uid, uid, UID_SIZE_MIFARE_CLASSIC);
+  }
+  
+  char uid_text[3 * sizeof(card->uid)];
+  LOG_TRACE(chip, "Card %d UID: %s\n", index + 1, format_hex(uid_text, card->uid, card->uid_length));
+}
+
+// Card memory is copy-on-write in CARD_CHUNK_SIZE chunks: chunks read from
+// the card's loaded dump, or else its type's factory contents, until the
+// card first writes to them.
+
+static const card_type_t *card_type_of(const virtual_card_t *card) {
+  return &card_types[card->card_type];
+}
+
+static int card_chunk_count(const virtual_card_t *card) {
+  return (card_type_of(card)->memory_size + CARD_CHUNK_SIZE - 1) / CARD_CHUNK_SIZE;
+}
+
+// Read-only view of card memory from offset to the end of its chunk
+static const uint8_t *card_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset) {
+  int chunk = offset / CARD_CHUNK_SIZE;
+  
+  if (card->chunks != NULL && card->chunks[chunk] != NULL) {
+    return &card->chunks[chunk][offset % CARD_CHUNK_SIZE];
+  }
+  return card_base_data(chip, card, offset);
+}
+
+// Card memory as it was before any write
+static const uint8_t *card_base_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset) {
+  if (card->image != NULL) {
+    return &card->image[offset];
+  }
+  return card_type_of(card)->factory_chunk(chip, card, offset / CARD_CHUNK_SIZE) + offset % CARD_CHUNK_SIZE;
+}
+
+// Writable view of card memory, giving the card its own copy of the chunk
+// first. Callers write within the CARD_SUM_BLOCK_SIZE block at offset.
+static uint8_t *card_data_for_write(chip_state_t *chip, virtual_card_t *card, uint32_t offset) {
+  int chunk = offset / CARD_CHUNK_SIZE;
+  
+  if (card->block_sums != NULL) {
+    card->block_sums[offset / CARD_SUM_BLOCK_SIZE] = -1;
+  }
+  if (card->chunks == NULL) {
+    card->chunks = calloc(card_chunk_count(card), sizeof(uint8_t *));
+  }
+  if (card->chunks[chunk] == NULL) {
+    uint8_t *copy = malloc(CARD_CHUNK_SIZE);
+    memcpy(copy, card_base_data(chip, card, chunk * CARD_CHUNK_SIZE), CARD_CHUNK_SIZE);
+    card->chunks[chunk] = copy;
+  }
+  return &card->chunks[chunk][offset % CARD_CHUNK_SIZE];
+}
+
+// Append a range of card memory that may span chunks to the response
+// payload, without copying it. Only the card's factory chunk 0 lives in
+// shared scratch, and one range never covers it twice. Whole blocks take
+// their byte sum from the cache, so DCS costs a few additions.
+static void respond_card_data(chip_state_t *chip, virtual_card_t *card, uint32_t offset, uint32_t length) {
+  while (length > 0) {
+    uint32_t count = CARD_CHUNK_SIZE - offset % CARD_CHUNK_SIZE;
+    const uint8_t *data = card_data(chip, card, offset);
+    uint8_t sum = 0;
+    
+    if (count > length) {
+      count = length;
+    }
+    for (uint32_t i = 0; i < count; ) {
+      if ((offset + i) % CARD_SUM_BLOCK_SIZE == 0 && count - i >= CARD_SUM_BLOCK_SIZE) {
+        sum += card_block_sum(chip, card, (offset + i) / CARD_SUM_BLOCK_SIZE);
+        i += CARD_SUM_BLOCK_SIZE;
+      } else {
+        sum += data[i++];
+      }
+    }
+    respond_bytes(chip, data, count, sum);
+    offset += count;
+    length -= count;
+  }
+}
+
+// Fragments that continue the previous one (an untouched loaded image) merge
+static void respond_bytes(chip_state_t *chip, const uint8_t *data, uint16_t length, uint8_t sum) {
+  uint8_t count = chip->response_fragment_count;
+  
+  if (count > 0 && chip->response_fragments[count - 1].data + chip->response_fragments[count - 1].length == data) {
+    chip->response_fragments[count - 1].length += length;
+    chip->response_fragments[count - 1].sum += sum;
+  } else {
+    response_fragment_t *fragment = &chip->response_fragments[chip->response_fragment_count++];
+    fragment->data = data;
+    fragment->length = length;
+    fragment->sum = sum;
+  }
+  chip->response_payload_length += length;
+}
+
+// Cached byte sum of one block of card memory; card_data_for_write() marks it stale
+static uint8_t card_block_sum(chip_state_t *chip, virtual_card_t *card, int block) {
+  if (card->block_sums == NULL) {
+    int blocks = (card_type_of(card)->memory_size + CARD_SUM_BLOCK_SIZE - 1) / CARD_SUM_BLOCK_SIZE;
+    card->block_sums = malloc(blocks * sizeof(int16_t));
+    memset(card->block_sums, 0xFF, blocks * sizeof(int16_t)); // All -1
+  }
+  if (card->block_sums[block] < 0) {
+    card->block_sums[block] = byte_sum(card_data(chip, card, block * CARD_SUM_BLOCK_SIZE), CARD_SUM_BLOCK_SIZE);
+  }
+  return card->block_sums[block];
+}
+
+static uint8_t byte_sum(const uint8_t *data, uint16_t length) {
+  uint8_t sum = 0;
+  
+  for (uint16_t i = 0; i < length; i++) {
+    sum += data[i];
+  }
+  return sum;
+}
+
+// Factory contents of a Classic sector chunk: zeros, with a sector trailer
+// (default keys and access bits) in the last block
+static const uint8_t factory_sector[CARD_CHUNK_SIZE] = {
+  [48] = 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, // Key A
+  0xFF, 0x07, 0x80, 0x69,                    // Access bits
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,        // Key B
+};
+
+static const uint8_t factory_zeros[CARD_CHUNK_SIZE];
+
+// Chunk 0 also holds the manufacturer block (UID, BCC, SAK, ATQA), built in
+// the chip's scratch chunk. Chunks of a 16-block sector only have a trailer
+// in the sector's last chunk.
+static const uint8_t *classic_factory_chunk(chip_state_t *chip, virtual_card_t *card, int chunk) {
+  int last_block = chunk * MIFARE_CLASSIC_BLOCKS_PER_SECTOR + MIFARE_CLASSIC_BLOCKS_PER_SECTOR - 1;
+  const card_type_t *type = card_type_of(card);
+  uint8_t *data = chip->factory_chunk;
+  
+  if (chunk == 0) {
+    memcpy(data, factory_sector, CARD_CHUNK_SIZE);
+    memcpy(data, card->uid, UID_SIZE_MIFARE_CLASSIC);
+    data[4] = card->uid[0] ^ card->uid[1] ^ card->uid[2] ^ card->uid[3]; // BCC
+    data[5] = type->sak;
+    data[6] = type->atqa[1];
+    data[7] = type->atqa[0];
+    return data;
+  }
+  if (classic_sector_trailer(classic_sector(last_block)) == last_block) {
+    return factory_sector;
+  }
+  return factory_zeros;
+}
+
+// Pages 0-2 hold the 7-byte UID and its check bytes, page 3 the capability
+// container and page 4 an empty NDEF message TLV
+static const uint8_t *ntag_factory_chunk(chip_state_t *chip, virtual_card_t *card, int chunk) {
+  const card_type_t *type = card_type_of(card);
+  uint8_t *data = chip->factory_chunk;
+  
+  if (chunk != 0) {
+    return factory_zeros;
+  }
+  memset(data, 0, CARD_CHUNK_SIZE);
+  memcpy(&data[0], &card->uid[0], 3);
+  data[3] = 0x88 ^ card->uid[0] ^ card->uid[1] ^ card->uid[2]; // BCC0 (includes cascade tag)
+  memcpy(&data[4], &card->uid[3], 4);
+  data[8] = card->uid[3] ^ card->uid[4] ^ card->uid[5] ^ card->uid[6]; // BCC1
+  data[9] = 0x48; // Internal
+  data[12] = 0xE1; // NDEF magic number
+  data[13] = 0x10; // Mapping version 1.0
+  data[14] = type->cc_size;
+  if (type->version != NULL) {
+    data[16] = 0x03; // NDEF message TLV, empty
+    data[18] = 0xFE; // Terminator TLV
+  }
+  return data;
+}
+
+// The UID of a loaded image comes from its manufacturer block
+static void classic_image_loaded(chip_state_t *chip, virtual_card_t *card) {
+  memcpy(card->uid, card->image, UID_SIZE_MIFARE_CLASSIC);
+  card->uid_length = UID_SIZE_MIFARE_CLASSIC;
+  
+  for (int sector = 0; sector < card_type_of(card)->sector_count; sector++) {
+    update_sector_access(chip, card, sector);
+  }
+}
+
+// Pages 0-1, skipping BCC0
+static void ntag_image_loaded(chip_state_t *chip, virtual_card_t *card) {
+  memcpy(&card->uid[0], &card->image[0], 3);
+  memcpy(&card->uid[3], &card->image[4], 4);
+  card->uid_length = UID_SIZE_NTAG;
+}
+
+static int classic_sector(int block) {
+  if (block < MIFARE_CLASSIC_SMALL_SECTORS * MIFARE_CLASSIC_BLOCKS_PER_SECTOR) {
+    return block / MIFARE_CLASSIC_BLOCKS_PER_SECTOR;
+  }
+  return MIFARE_CLASSIC_SMALL_SECTORS +
+         (block - MIFARE_CLASSIC_SMALL_SECTORS * MIFARE_CLASSIC_BLOCKS_PER_SECTOR) / MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS;
+}
+
+static int classic_sector_trailer(int sector) {
+  if (sector < MIFARE_CLASSIC_SMALL_SECTORS) {
+    return sector * MIFARE_CLASSIC_BLOCKS_PER_SECTOR + MIFARE_CLASSIC_BLOCKS_PER_SECTOR - 1;
+  }
+  return MIFARE_CLASSIC_SMALL_SECTORS * MIFARE_CLASSIC_BLOCKS_PER_SECTOR +
+         (sector - MIFARE_CLASSIC_SMALL_SECTORS + 1) * MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS - 1;
+}
+
+// Access condition group of a block: 0-2 for data blocks (five blocks each
+// in a 16-block sector), MIFARE_CLASSIC_TRAILER_GROUP for the trailer
+static int classic_block_group(int block) {
+  int offset;
+  
+  if (block < MIFARE_CLASSIC_SMALL_SECTORS * MIFARE_CLASSIC_BLOCKS_PER_SECTOR) {
+    return block % MIFARE_CLASSIC_BLOCKS_PER_SECTOR;
+  }
+  offset = (block - MIFARE_CLASSIC_SMALL_SECTORS * MIFARE_CLASSIC_BLOCKS_PER_SECTOR) % MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS;
+  return offset == MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS - 1 ? MIFARE_CLASSIC_TRAILER_GROUP : offset / 5;
+}
+
+// Card write journal (journal attribute). Every card write appends one
+// fixed-size record to PN532_JOURNAL_FILE; at init the records are replayed
+// into the cards' memory, on top of any loaded dumps. Once enough records
+// have piled up the file is rewritten with one record per modified block.
+// File layout: the PN532_JOURNAL_MAGIC magic (4 bytes), then records of
+// UID length, UID (7 bytes, zero padded), block number and 16 data bytes.
+// A block is JOURNAL_BLOCK_SIZE bytes of card memory whatever the card
+// type, so an Ultralight / NTAG block covers four pages.
+
+static void open_journal(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  uint32_t live = 0;
+  FILE *file;
+  
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_JOURNAL_FILE);
+  file = fopen(path, "rb");
+  if (file != NULL) {
+    chip->journal_records = replay_journal(chip, file);
+    fclose(file);
+    
+    for (int i = 0; i < chip->card_count; i++) {
+      if (chip->cards[i].chunks != NULL) {
+        live++;
+      }
+    }
+    LOG_INFO(chip, "Replayed %u journal record(s) onto %u card(s)\n", chip->journal_records, live);
+  }
+  
+  compact_journal(chip); // Also creates the file with its header
+}
+
+// Returns the number of records applied; a torn record at the end of the
+// file (simulation stopped mid-write) is dropped
+static uint32_t replay_journal(chip_state_t *chip, FILE *file) {
+  uint8_t magic[4];
+  uint8_t record[JOURNAL_RECORD_SIZE];
+  uint32_t count = 0;
+  
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, PN532_JOURNAL_MAGIC, sizeof(magic)) != 0) {
+    LOG_ERROR(chip, "Journal file has a bad header, ignoring it\n");
+    return 0;
+  }
+  
+  while (fread(record, 1, sizeof(record), file) == sizeof(record)) {
+    uint8_t uid_length = record[0];
+    uint8_t block = record[8];
+    int index = find_card_by_uid(chip, &record[1], uid_length);
+    
+    if (index < 0 || block * JOURNAL_BLOCK_SIZE >= card_type_of(&chip->cards[index])->memory_size) {
+      char uid_text[3 * sizeof(chip->cards[0].uid)];
+      LOG_ERROR(chip, "Skipping journal record for card %s block %d\n",
+                format_hex(uid_text, &record[1], uid_length > 7 ? 7 : uid_length), block);
+      continue;
+    }
+    virtual_card_t *card = &chip->cards[index];
+    memcpy(card_data_for_write(chip, card, block * JOURNAL_BLOCK_SIZE), &record[9], JOURNAL_BLOCK_SIZE);
+    if (card_type_of(card)->sector_count > 0 && classic_block_group(block) == MIFARE_CLASSIC_TRAILER_GROUP) {
+      update_sector_access(chip, card, classic_sector(block));
+    }
+    count++;
+  }
+  return count;
+}
+
+static void journal_append(chip_state_t *chip, virtual_card_t *card, int block) {
+  if (chip->journal == NULL) {
+    return;
+  }
+  
+  write_journal_record(chip->journal, card, block, card_data(chip, card, block * JOURNAL_BLOCK_SIZE));
+  fflush(chip->journal); // The simulation can stop at any moment
+  
+  if (++chip->journal_records >= chip->journal_compact_at) {
+    compact_journal(chip);
+  }
+}
+
+// Rewrite the journal from the current card contents into a temporary file
+// and rename it over the old one, so an interrupted compaction loses nothing
+static void compact_journal(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  char temp_path[sizeof(PN532_DUMP_DIR) + 32];
+  uint32_t live;
+  FILE *file;
+  
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_JOURNAL_FILE);
+  snprintf(temp_path, sizeof(temp_path), "%s%s", PN532_DUMP_DIR, PN532_JOURNAL_TEMP_FILE);
+  
+  if (chip->journal != NULL) {
+    fclose(chip->journal);
+    chip->journal = NULL;
+  }
+  
+  file = fopen(temp_path, "wb");
+  if (file == NULL) {
+    LOG_ERROR(chip, "Cannot create %s, card writes will not persist\n", temp_path);
+    return;
+  }
+  fwrite(PN532_JOURNAL_MAGIC, 1, 4, file);
+  live = write_journal_records(chip, file);
+  if (fclose(file) != 0 || rename(temp_path, path) != 0) {
+    LOG_ERROR(chip, "Journal compaction failed, card writes will not persist\n");
+    return;
+  }
+  
+  LOG_TRACE(chip, "Compacted journal from %u to %u record(s)\n", chip->journal_records, live);
+  chip->journal_records = live;
+  chip->journal_compact_at = live * 2 > JOURNAL_COMPACT_RECORDS ? live * 2 : JOURNAL_COMPACT_RECORDS;
+  
+  chip->journal = fopen(path, "ab");
+  if (chip->journal == NULL) {
+    LOG_ERROR(chip, "Cannot open %s, card writes will not persist\n", path);
+  }
+}
+
+// One record for every block that differs from the card's dump or factory contents
+static uint32_t write_journal_records(chip_state_t *chip, FILE *file) {
+  uint32_t count = 0;
+  
+  for (int i = 0; i < chip->card_count; i++) {
+    virtual_card_t *card = &chip->cards[i];
+    
+    if (card->chunks == NULL) {
+      continue;
+    }
+    for (int chunk = 0; chunk < card_chunk_count(card); chunk++) {
+      if (card->chunks[chunk] == NULL) {
+        continue;
+      }
+      for (int j = 0; j < CARD_CHUNK_SIZE / JOURNAL_BLOCK_SIZE; j++) {
+        int block = chunk * (CARD_CHUNK_SIZE / JOURNAL_BLOCK_SIZE) + j;
+        const uint8_t *data = &card->chunks[chunk][j * JOURNAL_BLOCK_SIZE];
+        
+        if (memcmp(data, card_base_data(chip, card, block * JOURNAL_BLOCK_SIZE), JOURNAL_BLOCK_SIZE) != 0) {
+          write_journal_record(file, card, block, data);
+          count++;
+        }
+      }
+    }
+  }
+  return count;
+}
+
+static void write_journal_record(FILE *file, virtual_card_t *card, int block, const uint8_t *data) {
+  uint8_t record[JOURNAL_RECORD_SIZE] = {0};
+  
+  record[0] = card->uid_length;
+  memcpy(&record[1], card->uid, card->uid_length);
+  record[8] = block;
+  memcpy(&record[9], data, JOURNAL_BLOCK_SIZE);
+  fwrite(record, 1, sizeof(record), file);
+}
+
+static uint32_t uid_hash(const uint8_t *uid, uint8_t uid_length) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (int i = 0; i < uid_length; i++) {
+    hash = (hash ^ uid[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Index a card by UID; fails if another card already has the same UID
+static bool register_card_uid(chip_state_t *chip, int index) {
+  virtual_card_t *card = &chip->cards[index];
+  uint32_t slot = uid_hash(card->uid, card->uid_length) & chip->uid_index_mask;
+  
+  if (find_card_by_uid(chip, card->uid, card->uid_length) >= 0) {
+    return false;
+  }
+  while (chip->uid_index[slot] != 0) {
+    slot = (slot + 1) & chip->uid_index_mask;
+  }
+  chip->uid_index[slot] = index + 1; // 0 marks an empty slot
+  return true;
+}
+
+// Returns the registry index of the card with this UID, or -1
+static int find_card_by_uid(chip_state_t *chip, const uint8_t *uid, uint8_t uid_length) {
+  uint32_t slot = uid_hash(uid, uid_length) & chip->uid_index_mask;
+  
+  while (chip->uid_index[slot] != 0) {
+    virtual_card_t *card = &chip->cards[chip->uid_index[slot] - 1];
+    if (card->uid_length == uid_length && memcmp(card->uid, uid, uid_length) == 0) {
+      return chip->uid_index[slot] - 1;
+    }
+    slot = (slot + 1) & chip->uid_index_mask;
+  }
+  return -1;
+}
+
+static void init_i2c_interface(chip_state_t *chip) {
+  const i2c_config_t i2c_config = {
+    .user_data = chip,
+    .address = PN532_I2C_ADDRESS,
+    .scl = pin_init("SCL", INPUT_PULLUP),
+    .sda = pin_init("SDA", INPUT_PULLUP),
+    .connect = on_i2c_connect,
+    .read = on_i2c_read,
+    .write = on_i2c_write,
+    .disconnect = on_i2c_disconnect,
+  };
+  chip->i2c = i2c_init(&i2c_config);
+}
+
+static bool on_i2c_connect(void *user_data, uint32_t address, bool read) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  if (!host_wakeup(chip, WAKEUP_I2C)) {
+    return false; // Powered down: no address match
+  }
+  // Every I2C read transaction starts with the status byte
+  chip->i2c_status_pending = read;
+  chip->tx_slot_done = false;
+  trace_begin(chip, read ? TRACE_READ : TRACE_WRITE);
+  return true; // Always ACK
+}
+
+static uint8_t on_i2c_read(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  uint8_t byte = i2c_read_byte(chip);
+  
+  trace_byte(chip, byte);
+  return byte;
+}
+
+static uint8_t i2c_read_byte(chip_state_t *chip) {
+  STATS_ADD(chip, bytes_out, 1);
+  if (chip->i2c_status_pending) {
+    chip->i2c_status_pending = false;
+    return (chip->tx_index < chip->tx_ready_length) ? PN532_I2C_READY : PN532_I2C_BUSY;
+  }
+  
+  // Stream the prepared ACK + response frame, as far as it is ready
+  if (!chip->tx_slot_done && chip->tx_index < chip->tx_ready_length) {
+    uint8_t byte = head_response(chip)->data[chip->tx_index++];
+    if (chip->tx_index == chip->tx_ready_length) {
+      tx_advance(chip); // ACK or response fully consumed
+    }
+    return byte;
+  }
+  
+  return 0x00;
+}
+
+static bool on_i2c_write(void *user_data, uint8_t data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  trace_byte(chip, data);
+  frame_parser_feed(chip, data);
+  
+  return true; // Always ACK
+}
+
+// Host-to-PN532 frame parser, one byte at a time. All state lives in chip->parser.
+static void frame_parser_feed(chip_state_t *chip, uint8_t data) {
+  frame_parser_t *parser = &chip->parser;
+  queued_command_t *rx = &chip->command_queue[(chip->command_queue_head + chip->command_queue_count) %
+                                              PN532_COMMAND_QUEUE_DEPTH];
+  
+  STATS_ADD(chip, bytes_in, 1);
+  switch (parser->state) {
+    case FRAME_STATE_PREAMBLE:
+      if (data == PN532_PREAMBLE) {
+        parser->state = FRAME_STATE_STARTCODE1;
+      }
+      break;
+    
+    case FRAME_STATE_STARTCODE1:
+      if (data == PN532_STARTCODE1) {
+        parser->state = FRAME_STATE_STARTCODE2;
+      } else if (data == PN532_STARTCODE2) {
+        parser->state = FRAME_STATE_LENGTH; // Preamble is optional
+      } else {
+        parser->state = FRAME_STATE_PREAMBLE; // Reset
+      }
+      break;
+    
+    case FRAME_STATE_STARTCODE2:
+      if (data == PN532_STARTCODE2) {
+        parser->state = FRAME_STATE_LENGTH;
+      } else if (data != PN532_STARTCODE1) { // Extra zeros (e.g. HSU wakeup preamble) are skipped
+        parser->state = FRAME_STATE_PREAMBLE; // Reset
+      }
+      break;
+    
+    case FRAME_STATE_LENGTH:
+      parser->length = data;
+      parser->state = FRAME_STATE_LENGTH_CHECKSUM;
+      break;
+    
+    case FRAME_STATE_LENGTH_CHECKSUM:
+      if (parser->length == 0xFF && data == 0xFF) {
+        // Extended frame: 00 00 FF FF FF LENM LENL LCS
+        parser->state = FRAME_STATE_EXT_LENGTH_MSB;
+      } else if (parser->length == 0x00 && data == 0xFF) {
+        // ACK frame from the host (00 00 FF 00 FF 00): abort
+        abort_commands(chip);
+        parser->state = FRAME_STATE_PREAMBLE;
+      } else if (parser->length == 0xFF && data == 0x00) {
+        // NACK frame (00 00 FF FF 00 00): send the last response again
+        resend_response(chip);
+        parser->state = FRAME_STATE_PREAMBLE;
+      } else if ((parser->length + data) & 0xFF) {
+        // Length checksum error
+        STATS_ADD(chip, checksum_errors, 1);
+        parser->state = FRAME_STATE_PREAMBLE;
+      } else {
+        frame_parser_start_data(parser);
+      }
+      break;
+    
+    case FRAME_STATE_EXT_LENGTH_MSB:
+      parser->length = data << 8;
+      parser->length_checksum = data;
+      parser->state = FRAME_STATE_EXT_LENGTH_LSB;
+      break;
+    
+    case FRAME_STATE_EXT_LENGTH_LSB:
+      parser->length |= data;
+      parser->length_checksum += data;
+      parser->state = FRAME_STATE_EXT_LENGTH_CHECKSUM;
+      break;
+    
+    case FRAME_STATE_EXT_LENGTH_CHECKSUM:
+      if ((parser->length_checksum + data) & 0xFF) {
+        // Length checksum error
+        STATS_ADD(chip, checksum_errors, 1);
+        parser->state = FRAME_STATE_PREAMBLE;
+      } else {
+        frame_parser_start_data(parser);
+      }
+      break;
+    
+    case FRAME_STATE_TFI: // Host to PN532
+      if (data == PN532_HOSTTOPN532 && chip->command_queue_count == PN532_COMMAND_QUEUE_DEPTH) {
+        LOG_ERROR(chip, "Command queue full, frame dropped\n");
+        parser->state = FRAME_STATE_PREAMBLE;
+      } else if (data == PN532_HOSTTOPN532) {
+        parser->state = FRAME_STATE_COMMAND;
+        parser->checksum = data;
+      } else {
+        parser->state = FRAME_STATE_PREAMBLE; // Reset
+      }
+      break;
+    
+    case FRAME_STATE_COMMAND:
+      rx->data[0] = data;
+      parser->data_index = 1;
+      parser->checksum += data;
+      parser->state = FRAME_STATE_DATA;
+      break;
+    
+    case FRAME_STATE_DATA:
+      if (parser->data_index < parser->length - 1) { // -1 because we already got command byte
+        rx->data[parser->data_index] = data;
+        parser->checksum += data;
+        parser->data_index++;
+      } else {
+        // This should be the checksum
+        if ((parser->checksum + data) & 0xFF) {
+          // Checksum error
+          STATS_ADD(chip, checksum_errors, 1);
+          parser->state = FRAME_STATE_PREAMBLE;
+        } else {
+          parser->state = FRAME_STATE_POSTAMBLE;
+        }
+      }
+      break;
+    
+    case FRAME_STATE_POSTAMBLE:
+      if (data == PN532_POSTAMBLE) {
+        // Valid frame received: queue it, it runs as soon as the chip is free
+        rx->length = parser->length - 1; // -1 because we don't include TFI
+        STATS_ADD(chip, frames, 1);
+        STATS_ADD(chip, commands[rx->data[0]], 1);
+        queue_command(chip);
+      }
+      parser->state = FRAME_STATE_PREAMBLE; // Reset
+      break;
+  }
+}
+
+// Validate LEN (TFI + command + data) and move on to the frame body
+static void frame_parser_start_data(frame_parser_t *parser) {
+  if (parser->length < 2 || parser->length > PN532_MAX_FRAME_LENGTH) {
+    // Empty or oversized frame: drop it rather than overrun the queue entry
+    parser->state = FRAME_STATE_PREAMBLE;
+    return;
+  }
+  parser->state = FRAME_STATE_TFI;
+  parser->data_index = 0;
+  parser->checksum = 0;
+}
+
+static void on_i2c_disconnect(void *user_data) {
+  trace_end((chip_state_t *)user_data);
+}
+
+// I2C protocol trace (trace attribute). Every host transaction becomes one
+// record in PN532_TRACE_FILE: the bytes the host wrote, or the bytes it read
+// (status byte included), so bench/replay.c can feed a session back into the
+// chip and check its answers. File layout: the PN532_TRACE_MAGIC magic, then
+// records of kind (TRACE_WRITE / TRACE_READ), the transaction start in ns
+// since the previous record and the byte count, both as LEB128 varints, and
+// the bytes themselves. A transaction longer than TRACE_MAX_RECORD goes on
+// in records whose kind has TRACE_CONTINUED set ('w' / 'r').
+
+static void open_trace(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_TRACE_FILE);
+  chip->trace = fopen(path, "wb");
+  if (chip->trace == NULL) {
+    LOG_ERROR(chip, "Cannot create %s\n", path);
+    return;
+  }
+  fwrite(PN532_TRACE_MAGIC, 1, 4, chip->trace);
+}
+
+static void trace_begin(chip_state_t *chip, uint8_t kind) {
+  if (chip->trace == NULL) {
+    return;
+  }
+  trace_end(chip); // Repeated start without a stop
+  chip->trace_kind = kind;
+  chip->trace_start_ns = get_sim_nanos();
+}
+
+static void trace_byte(chip_state_t *chip, uint8_t data) {
+  if (chip->trace == NULL) {
+    return;
+  }
+  if (chip->trace_length == TRACE_MAX_RECORD) {
+    uint8_t kind = chip->trace_kind;
+    trace_end(chip);
+    chip->trace_kind = kind | TRACE_CONTINUED; // Same transaction and time stamp
+  }
+  chip->trace_buffer[chip->trace_length++] = data;
+}
+
+static void trace_end(chip_state_t *chip) {
+  if (chip->trace == NULL || chip->trace_length == 0) {
+    return;
+  }
+  fputc(chip->trace_kind, chip->trace);
+  trace_varint(chip->trace, chip->trace_start_ns - chip->trace_last_ns);
+  trace_varint(chip->trace, chip->trace_length);
+  fwrite(chip->trace_buffer, 1, chip->trace_length, chip->trace);
+  fflush(chip->trace); // The simulation can stop at any moment
+  
+  chip->trace_last_ns = chip->trace_start_ns;
+  chip->trace_length = 0;
+}
+
+static void trace_varint(FILE *file, uint64_t value) {
+  while (value >= 0x80) {
+    fputc((value & 0x7F) | 0x80, file);
+    value >>= 7;
+  }
+  fputc(value, file);
+}
+
+// SPI transport. Each SS-low transaction starts with a prefix byte (status
+// read, data write or data read); everything after it moves as one buffer
+// per spi_start() call rather than byte by byte.
+
+static void init_spi_interface(chip_state_t *chip) {
+  chip->pin_ss = pin_init("SS", INPUT_PULLUP);
+  chip->spi_lsb_first = read_attr(chip, chip->spi_lsb_first_attr);
+  
+  const spi_config_t spi_config = {
+    .user_data = chip,
+    .sck = pin_init("SCK", INPUT),
+    .mosi = pin_init("MOSI", INPUT),
+    .miso = pin_init("MISO", INPUT),
+    .mode = 0,
+    .done = on_spi_done,
+  };
+  chip->spi = spi_init(&spi_config);
+  
+  const pin_watch_config_t ss_watch_config = {
+    .user_data = chip,
+    .edge = BOTH,
+    .pin_change = on_spi_ss_change,
+  };
+  pin_watch(chip->pin_ss, &ss_watch_config);
+}
+
+static void on_spi_ss_change(void *user_data, pin_t pin, uint32_t value) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  if (value == LOW) {
+    if (!host_wakeup(chip, WAKEUP_SPI)) {
+      return; // Powered down: the transaction is ignored
+    }
+    // Transaction start: clock in the prefix byte
+    chip->spi_selected = true;
+    chip->tx_slot_done = false;
+    chip->spi_phase = SPI_PHASE_PREFIX;
+    chip->spi_buffer[0] = 0x00;
+    spi_start(chip->spi, chip->spi_buffer, 1);
+  } else if (chip->spi_selected) {
+    // Transaction end: on_spi_done() sees the partial transfer
+    chip->spi_selected = false;
+    spi_stop(chip->spi);
+  }
+}
+
+static void on_spi_done(void *user_data, uint8_t *buffer, uint32_t count) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  switch (chip->spi_phase) {
+    case SPI_PHASE_PREFIX: {
+      if (count == 0) {
+        break;
+      }
+      uint8_t prefix = spi_byte(chip, buffer[0]);
+      if (prefix == PN532_SPI_STATREAD) {
+        chip->spi_phase = SPI_PHASE_STATUS;
+        buffer[0] = spi_byte(chip, (chip->tx_index < chip->tx_ready_length) ? PN532_I2C_READY : PN532_I2C_BUSY);
+        spi_continue(chip, 1);
+      } else if (prefix == PN532_SPI_DATAREAD) {
+        spi_start_data_read(chip);
+      } else if (prefix == PN532_SPI_DATAWRITE) {
+        chip->spi_phase = SPI_PHASE_DATA_WRITE;
+        spi_continue(chip, sizeof(chip->spi_buffer));
+      } else {
+        chip->spi_phase = SPI_PHASE_IDLE;
+      }
+      break;
+    }
+    
+    case SPI_PHASE_STATUS:
+      // Status byte sent; anything else clocked in this transaction is ignored
+      chip->spi_phase = SPI_PHASE_IDLE;
+      break;
+    
+    case SPI_PHASE_DATA_READ:
+      // Only frame bytes count; filler zeros clocked while nothing was ready,
+      // or past the end of a slot (tx_slot_done), must not eat into a
+      // response that became ready meanwhile or into the next slot
+      if (chip->spi_frame_bytes > 0) {
+        tx_consume(chip, count < chip->spi_frame_bytes ? count : chip->spi_frame_bytes);
+      }
+      spi_start_data_read(chip); // Keep going while SS is low
+      break;
+    
+    case SPI_PHASE_DATA_WRITE:
+      for (uint32_t i = 0; i < count; i++) {
+        frame_parser_feed(chip, spi_byte(chip, buffer[i]));
+      }
+      spi_continue(chip, sizeof(chip->spi_buffer));
+      break;
+    
+    default:
+      break;
+  }
+}
+
+// Load the ready part of the tx frame into the SPI buffer in one go
+static void spi_start_data_read(chip_state_t *chip) {
+  // Frame bytes never run on from a slot read in full into the next one
+  uint16_t available = chip->tx_slot_done ? 0 : chip->tx_ready_length - chip->tx_index;
+  
+  chip->spi_phase = SPI_PHASE_DATA_READ;
+  chip->spi_frame_bytes = available;
+  if (available == 0) {
+    // Nothing (more) to send: clock out zeros until SS goes high
+    memset(chip->spi_buffer, 0, sizeof(chip->spi_buffer));
+    available = sizeof(chip->spi_buffer);
+  } else {
+    for (uint16_t i = 0; i < available; i++) {
+      chip->spi_buffer[i] = spi_byte(chip, head_response(chip)->data[chip->tx_index + i]);
+    }
+  }
+  spi_continue(chip, available);
+}
+
+static void spi_continue(chip_state_t *chip, uint32_t count) {
+  if (chip->spi_selected) {
+    spi_start(chip->spi, chip->spi_buffer, count);
+  } else {
+    chip->spi_phase = SPI_PHASE_IDLE;
+  }
+}
+
+// The PN532 shifts SPI data LSB first; convert when the bus is MSB first
+static uint8_t spi_byte(chip_state_t *chip, uint8_t value) {
+  if (!chip->spi_lsb_first) {
+    return value;
+  }
+  value = (value & 0xF0) >> 4 | (value & 0x0F) << 4;
+  value = (value & 0xCC) >> 2 | (value & 0x33) << 2;
+  value = (value & 0xAA) >> 1 | (value & 0x55) << 1;
+  return value;
+}
+
+// HSU (high speed UART) transport. The PN532 pushes the ACK and the
+// response to the host on its own, each as a single uart_write().
+
+static void init_hsu_interface(chip_state_t *chip) {
+  const uart_config_t uart_config = {
+    .user_data = chip,
+    .rx = pin_init("RX", INPUT_PULLUP),
+    .tx = pin_init("TX", INPUT_PULLUP),
+    .baud_rate = read_attr(chip, chip->hsu_baud_attr),
+    .rx_data = on_hsu_rx_data,
+    .write_done = on_hsu_write_done,
+  };
+  chip->uart = uart_init(&uart_config);
+}
+
+static void on_hsu_rx_data(void *user_data, uint8_t byte) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  // Wakeup bytes (0x55 0x55 00 00 00 ...) are skipped by the frame parser
+  if (host_wakeup(chip, WAKEUP_HSU)) {
+    frame_parser_feed(chip, byte);
+  }
+}
+
+static void on_hsu_write_done(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  chip->hsu_writing = false;
+  hsu_flush(chip); // The response may have become ready meanwhile
+}
+
+// Send whatever part of the head response slot is ready as one buffered write
+static void hsu_flush(chip_state_t *chip) {
+  uint16_t available = chip->tx_ready_length - chip->tx_index;
+  
+  if (chip->hsu_writing || available == 0) {
+    return;
+  }
+  
+  // Copy out so the slot can be reused while the UART is busy
+  memcpy(chip->hsu_buffer, &head_response(chip)->data[chip->tx_index], available);
+  if (uart_write(chip->uart, chip->hsu_buffer, available)) {
+    chip->hsu_writing = true;
+    tx_consume(chip, available);
+  }
+}
+
+// The host has read count more bytes of the ready part of the head slot
+static void tx_consume(chip_state_t *chip, uint32_t count) {
+  uint16_t available = chip->tx_ready_length - chip->tx_index;
+  
+  STATS_ADD(chip, bytes_out, count < available ? count : available);
+  if (count >= available) {
+    chip->tx_index = chip->tx_ready_length;
+    tx_advance(chip); // ACK or response fully consumed
+  } else {
+    chip->tx_index += count;
+  }
+}
+
+static void on_timer(void *user_data) {
+  finish_processing((chip_state_t *)user_data);
+}
+
+// The ACK is available right away; the response once the simulated
+// processing time has elapsed (immediately in fast timing mode)
+static void start_response(chip_state_t *chip) {
+  timer_stop(chip->timer);
+  running_response(chip)->ready = false;
+  if (chip->timing_mode == TIMING_MODE_FAST) {
+    finish_processing(chip);
+  } else {
+    timer_start_ns(chip->timer, chip->response_latency_ns, false);
+    notify_host(chip);
+  }
+}
+
+// Processing time elapsed: the response can follow the ACK, and unless the
+// command is held the next queued command may start
+static void finish_processing(chip_state_t *chip) {
+  set_response_ready(chip);
+  if (chip->command_held) {
+    notify_host(chip);
+    return;
+  }
+  chip->command_running = false;
+  tx_advance(chip); // A cancelled command's bare ACK may have been read already
+}
+
+static void set_response_ready(chip_state_t *chip) {
+  response_slot_t *slot = running_response(chip);
+  
+  slot->ready = true;
+#if PN532_STATS
+  if (slot->length > PN532_ACK_PACKET_SIZE) { // Not a held command's bare ACK
+    stats_record_latency(chip, get_sim_nanos() - chip->stats.ack_ns);
+  }
+#endif
+}
+
+// Command pipeline. A frame that arrives while a command runs waits in the
+// command queue; the next command starts once the running one has finished
+// processing and a response slot is free, so a host may send its next
+// command before it has read the previous response. The chip still runs
+// one command at a time, as the PN532 firmware does.
+
+static response_slot_t *head_response(chip_state_t *chip) {
+  return &chip->responses[chip->response_head];
+}
+
+// Slot of the running command, the newest one in use
+static response_slot_t *running_response(chip_state_t *chip) {
+  return &chip->responses[(chip->response_head + chip->response_count - 1) % PN532_RESPONSE_RING_DEPTH];
+}
+
+// The parser has filled the entry behind the queue. A response the host
+// has started to read, but not to the end, is dropped: the host has moved on.
+static void queue_command(chip_state_t *chip) {
+  chip->command_queue_count++;
+  cancel_held_command(chip); // A new frame replaces a held command
+  if (chip->response_count > 0 && chip->tx_index > PN532_ACK_PACKET_SIZE) {
+    chip->tx_index = head_response(chip)->length;
+  }
+  tx_advance(chip);
+}
+
+static void run_next_command(chip_state_t *chip) {
+  queued_command_t *next = &chip->command_queue[chip->command_queue_head];
+  response_slot_t *slot;
+  
+  if (chip->command_running || chip->command_queue_count == 0 ||
+      chip->response_count == PN532_RESPONSE_RING_DEPTH ||
+      (chip->response_count > 0 && running_response(chip)->power_down)) {
+    return; // Busy, or going to sleep
+  }
+  
+  chip->command = next->data[0];
+  memcpy(chip->command_data, next->data, next->length);
+  chip->command_length = next->length;
+  chip->command_queue_head = (chip->command_queue_head + 1) % PN532_COMMAND_QUEUE_DEPTH;
+  chip->command_queue_count--;
+  
+  chip->response_count++;
+  slot = running_response(chip);
+  slot->length = 0;
+  slot->power_down = false;
+  chip->command_running = true;
+#if PN532_STATS
+  chip->stats.ack_ns = get_sim_nanos();
+#endif
+  
+  // Command boundary: pick up card changes before the command runs
+  sample_card_field(chip);
+  process_command(chip);
+  start_response(chip);
+}
+
+// Drop queued commands, the running one and every unread response
+static void abort_commands(chip_state_t *chip) {
+  cancel_held_command(chip);
+  timer_stop(chip->timer);
+  chip->command_running = false;
+  chip->command_queue_count = 0;
+  chip->response_count = 0;
+  chip->tx_index = 0;
+  update_irq(chip);
+  LOG_TRACE(chip, "Commands aborted\n");
+}
+
+// Host NACK: rewind the response the host is reading to just after its
+// ACK, or bring back the last response it has read in full
+static void resend_response(chip_state_t *chip) {
+  response_slot_t *head = head_response(chip);
+  
+  if (chip->response_count > 0) {
+    if (!head->ready || chip->tx_index <= PN532_ACK_PACKET_SIZE) {
+      return; // Nothing of the response sent yet
+    }
+  } else {
+    chip->response_head = (chip->response_head + PN532_RESPONSE_RING_DEPTH - 1) % PN532_RESPONSE_RING_DEPTH;
+    head = head_response(chip);
+    if (head->length <= PN532_ACK_PACKET_SIZE) {
+      chip->response_head = (chip->response_head + 1) % PN532_RESPONSE_RING_DEPTH;
+      return; // No response frame to repeat
+    }
+    chip->response_count = 1;
+  }
+  chip->tx_index = PN532_ACK_PACKET_SIZE;
+  notify_host(chip);
+  LOG_TRACE(chip, "Resending the last response\n");
+}
+
+// Held responses. A command that waits for a card (InListPassiveTarget with
+// retries, InAutoPoll) is ACKed but its response is held back; the field
+// sampler finishes it when a card arrives, or poll_timer when its time runs
+// out. The host sees a single transaction per card arrival.
+
+static void hold_command(chip_state_t *chip, uint64_t timeout_ns) {
+  chip->command_held = true;
+  if (timeout_ns > 0) {
+    timer_start_ns(chip->poll_timer, timeout_ns, false);
+  }
+  LOG_TRACE(chip, "Holding command 0x%02X until a card arrives\n", chip->command);
+}
+
+// A new host frame replaces a held command. Its bare ACK stays; once the
+// ACK's processing time is over the command is finished.
+static void cancel_held_command(chip_state_t *chip) {
+  if (chip->command_held) {
+    chip->command_held = false;
+    timer_stop(chip->poll_timer);
+    LOG_TRACE(chip, "Held command 0x%02X cancelled\n", chip->command);
+    if (running_response(chip)->ready) {
+      chip->command_running = false;
+    }
+  }
+}
+
+// The slot is rebuilt in place; the host may already have read the ACK
+static void complete_held_command(chip_state_t *chip, bool timed_out) {
+  chip->command_held = false;
+  chip->poll_timed_out = timed_out;
+  timer_stop(chip->poll_timer);
+  
+  process_command(chip);
+  chip->poll_timed_out = false;
+  start_response(chip);
+}
+
+static void on_poll_timer(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  if (chip->command_held) {
+    complete_held_command(chip, true);
+  }
+}
+
+// More of the head slot became ready: signal it on IRQ, and push it out on HSU
+static void notify_host(chip_state_t *chip) {
+  update_irq(chip);
+  if (chip->interface == INTERFACE_HSU) {
+    hsu_flush(chip);
+  }
+}
+
+// IRQ (active low) is asserted while the host has unread data, and
+// released as soon as the ACK or the response has been consumed
+static void update_irq(chip_state_t *chip) {
+  response_slot_t *head = head_response(chip);
+  bool assert_irq;
+  
+  if (chip->response_count == 0) {
+    chip->tx_ready_length = 0;
+  } else {
+    chip->tx_ready_length = (head->ready || head->length < PN532_ACK_PACKET_SIZE)
+                            ? head->length : PN532_ACK_PACKET_SIZE;
+  }
+  assert_irq = chip->tx_index < chip->tx_ready_length || chip->wakeup_irq;
+  
+  if (assert_irq != chip->irq_asserted) {
+    chip->irq_asserted = assert_irq;
+    pin_write(chip->pin_irq, assert_irq ? LOW : HIGH);
+  }
+}
+
+// PowerDown. The chip stops its timers and ignores host traffic except on
+// the enabled wakeup sources: an I2C address match, SPI select or HSU byte,
+// a card entering the field (RF) or a falling edge on REQ (INT0). A reset
+// always wakes it. Only the field sampler keeps running, and only for RF.
+
+// The host has read everything that is ready, or a command has finished.
+// A response read in full whose command is done frees its slot, and the
+// next command may start; a PowerDown response puts the chip to sleep.
+static void tx_advance(chip_state_t *chip) {
+  response_slot_t *head = head_response(chip);
+  
+  if (chip->response_count > 0 && head->ready && chip->tx_index == head->length &&
+      !(chip->command_running && chip->response_count == 1)) {
+    chip->response_head = (chip->response_head + 1) % PN532_RESPONSE_RING_DEPTH;
+    chip->response_count--;
+    chip->tx_index = 0;
+    chip->tx_slot_done = true;
+    if (head->power_down) {
+      update_irq(chip);
+      enter_power_down(chip);
+      return;
+    }
+  }
+  notify_host(chip); // The next slot may be ready already
+  run_next_command(chip);
+}
+
+// Every host transaction starts here; false in reset, or while powered down unless the
+// interface is a wakeup source (its frame then goes through, except on HSU
+// where the waking bytes are lost)
+static bool host_wakeup(chip_state_t *chip, uint8_t source) {
+  if (chip->in_reset) {
+    return false;
+  }
+  if (chip->wakeup_irq) {
+    chip->wakeup_irq = false;
+    update_irq(chip);
+  }
+  if (!chip->powered_down) {
+    return true;
+  }
+  if (!(chip->wakeup_enable & source)) {
+    return false;
+  }
+  wake_up(chip, "the host interface");
+  return source != WAKEUP_HSU;
+}
+
+static void enter_power_down(chip_state_t *chip) {
+  const pin_watch_config_t req_watch_config = {
+    .user_data = chip,
+    .edge = FALLING,
+    .pin_change = on_req_change,
+  };
+  
+  chip->powered_down = true;
+  chip->target_count = 0; // The RF field goes off
+  if (chip->command_queue_count > 0) {
+    LOG_INFO(chip, "%u queued command(s) dropped\n", chip->command_queue_count);
+  }
+  abort_commands(chip);
+  if (!(chip->wakeup_enable & WAKEUP_RF)) {
+    timer_stop(chip->field_timer);
+  }
+  
+  if (chip->wakeup_enable & WAKEUP_INT0) {
+    pin_watch(chip->pin_req, &req_watch_config);
+  }
+  LOG_INFO(chip, "Powered down, wakeup sources 0x%02X\n", chip->wakeup_enable);
+}
+
+static void wake_up(chip_state_t *chip, const char *source) {
+  chip->powered_down = false;
+  pin_watch_stop(chip->pin_req);
+  if (chip->field_sample_us > 0 && !(chip->wakeup_enable & WAKEUP_RF)) {
+    timer_start(chip->field_timer, chip->field_sample_us, true);
+  }
+  LOG_INFO(chip, "Woken up by %s\n", source);
+  
+  if (chip->wakeup_generate_irq) {
+    chip->wakeup_irq = true;
+    update_irq(chip);
+  }
+}
+
+static void on_req_change(void *user_data, pin_t pin, uint32_t value) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  if (chip->powered_down) {
+    wake_up(chip, "REQ");
+  }
+}
+
+// Hardware reset (RST, active low). The falling edge returns everything the
+// firmware holds in RAM to its power-on state, and the chip then stays in
+// that state, ignoring the host, until RST is released; the rising edge
+// only lets traffic through again.
+// Without a journal, a reset also undoes the cards' writes. A real tag keeps
+// its memory across a reader reset; this is an emulator convenience, a quick
+// way back to the dump or factory image between test runs. Only the chunks
+// a card has written are dropped, and with the journal configured the
+// cards' contents survive a reset as on real hardware.
+
+static void on_reset_change(void *user_data, pin_t pin, uint32_t value) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  chip->in_reset = (value == LOW);
+  if (chip->in_reset) {
+    reset_chip(chip);
+    LOG_INFO(chip, "Reset asserted\n");
+  } else {
+    LOG_INFO(chip, "Reset released\n");
+  }
+}
+
+static void reset_chip(chip_state_t *chip) {
+  if (chip->powered_down) {
+    wake_up(chip, "RST");
+  }
+  chip->wakeup_irq = false;
+  
+  // Parser, command queue and responses
+  chip->parser.state = FRAME_STATE_PREAMBLE;
+  abort_commands(chip);
+  for (int i = 0; i < PN532_RESPONSE_RING_DEPTH; i++) {
+    chip->responses[i].length = 0; // Nothing for a NACK to repeat
+  }
+  
+  // Initiator and target mode state
+  chip->target_count = 0;
+  chip->current_target = 0;
+  chip->passive_activation_retries = PN532_RETRIES_FOREVER;
+  chip->master_key_loaded = false;
+  timer_stop(chip->peer_timer);
+  chip->target_mode = TARGET_MODE_OFF;
+  
+  for (int i = 0; i < chip->card_count; i++) {
+    chip->cards[i].auth_sector = -1;
+    if (chip->journal == NULL) {
+      reset_card_memory(chip, &chip->cards[i]);
+    }
+  }
+}
+
+// Drop the card's written chunks, and with them the access conditions and
+// byte sums taken from them
+static void reset_card_memory(chip_state_t *chip, virtual_card_t *card) {
+  const card_type_t *type = card_type_of(card);
+  const int chunk_blocks = CARD_CHUNK_SIZE / MIFARE_CLASSIC_BLOCK_SIZE;
+  
+  if (card->chunks == NULL) {
+    return;
+  }
+  for (int chunk = 0; chunk < card_chunk_count(card); chunk++) {
+    if (card->chunks[chunk] == NULL) {
+      continue;
+    }
+    free(card->chunks[chunk]);
+    card->chunks[chunk] = NULL;
+    
+    // A Classic trailer in the chunk takes its access conditions from the base image again
+    for (int block = chunk * chunk_blocks; type->sector_count > 0 && block < (chunk + 1) * chunk_blocks; block++) {
+      if (classic_block_group(block) == MIFARE_CLASSIC_TRAILER_GROUP) {
+        update_sector_access(chip, card, classic_sector(block));
+      }
+    }
+  }
+  free(card->chunks);
+  card->chunks = NULL;
+  free(card->block_sums);
+  card->block_sums = NULL;
+}
+
+static void on_field_timer(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  sample_card_field(chip);
+}
+
+// Card field manager: the only place the card/reset attributes (and the
+// live log_level control) are read. Runs on the field timer tick and at frame
+// boundaries, never per I2C byte. Cards enter and leave the field set one at
+// a time as the controls change.
+static void sample_card_field(chip_state_t *chip) {
+  // Check attribute values for virtual card simulation
+  uint32_t card1_state = read_attr(chip, chip->card1_button);
+  uint32_t card2_state = read_attr(chip, chip->card2_button);
+  uint32_t reset_state = read_attr(chip, chip->reset_button);
+  
+  chip->log_level = read_attr(chip, chip->log_level_attr);
+  
+  // Handle reset button
+  if (reset_state) {
+    clear_card_field(chip);
+  }
+  
+  // Card index attributes: N puts card N in the field, 0 takes it out again (on change only)
+  for (int i = 0; i < CARD_INDEX_CONTROLS; i++) {
+    uint32_t selected_card = read_attr(chip, chip->card_index_attr[i]);
+    
+    if (selected_card == chip->selected_card[i]) {
+      continue;
+    }
+    if (chip->selected_card[i] > 0 && chip->selected_card[i] <= chip->card_count) {
+      remove_card(chip, chip->selected_card[i] - 1);
+    }
+    chip->selected_card[i] = selected_card;
+    if (selected_card > 0 && selected_card <= chip->card_count) {
+      place_card(chip, selected_card - 1);
+    }
+  }
+  
+  // The card buttons put card 1 or 2 in the field
+  if (card1_state && chip->cards[0].state == CARD_STATE_ABSENT) {
+    place_card(chip, 0);
+  }
+  if (card2_state && chip->cards[1].state == CARD_STATE_ABSENT) {
+    place_card(chip, 1);
+  }
+  
+  field_changed(chip);
+}
+
+// A held InListPassiveTarget / InAutoPoll completes on the first card
+static void field_changed(chip_state_t *chip) {
+  if (chip->command_held && chip->field_count > 0 &&
+      (chip->command == PN532_COMMAND_INLISTPASSIVETARGET || chip->command == PN532_COMMAND_INAUTOPOLL)) {
+    complete_held_command(chip, false);
+  }
+}
+
+static void place_card(chip_state_t *chip, int index) {
+  if (chip->cards[index].state == CARD_STATE_PRESENT) {
+    return;
+  }
+  if (chip->field_count == MAX_FIELD_CARDS) {
+    LOG_ERROR(chip, "Card field is full, card %d not placed\n", index + 1);
+    return;
+  }
+  
+  chip->cards[index].state = CARD_STATE_PRESENT;
+  chip->field_cards[chip->field_count++] = index;
+  LOG_INFO(chip, "Card %d placed in field\n", index + 1);
+  
+  // RF wakeup is a card entering an empty field; one already lying on the
+  // reader when PowerDown came in doesn't wake the chip again
+  if (chip->field_count == 1 && chip->powered_down && (chip->wakeup_enable & WAKEUP_RF)) {
+    wake_up(chip, "a card entering the field");
+  }
+}
+
+// Take a card out of the field; if it was a target its Tg stays unused
+// until the next InListPassiveTarget
+static void remove_card(chip_state_t *chip, int index) {
+  int i = 0;
+  
+  if (chip->cards[index].state != CARD_STATE_PRESENT) {
+    return;
+  }
+  while (chip->field_cards[i] != index) {
+    i++;
+  }
+  chip->field_cards[i] = chip->field_cards[--chip->field_count];
+  chip->cards[index].state = CARD_STATE_ABSENT;
+  
+  for (int tg = 0; tg < chip->target_count; tg++) {
+    if (chip->targets[tg] == index) {
+      chip->targets[tg] = -1;
+    }
+  }
+  LOG_INFO(chip, "Card %d removed from field\n", index + 1);
+}
+
+static void clear_card_field(chip_state_t *chip) {
+  if (chip->field_count == 0) {
+    return;
+  }
+  while (chip->field_count > 0) {
+    chip->cards[chip->field_cards[--chip->field_count]].state = CARD_STATE_ABSENT;
+  }
+  chip->target_count = 0;
+  LOG_INFO(chip, "Card field reset - all cards removed\n");
+}
+
+// Anticollision order: UIDs go out LSB first and at the first colliding bit
+// the reader keeps the cards sending a 1. 7-byte UIDs start with the
+// cascade tag at the first cascade level.
+static bool anticollision_wins(const virtual_card_t *a, const virtual_card_t *b) {
+  uint8_t a_bytes[UID_SIZE_NTAG + 1];
+  uint8_t b_bytes[UID_SIZE_NTAG + 1];
+  int length_a = cascade_uid(a, a_bytes);
+  int length_b = cascade_uid(b, b_bytes);
+  int length = length_a < length_b ? length_a : length_b;
+  
+  for (int i = 0; i < length; i++) {
+    uint8_t diff = a_bytes[i] ^ b_bytes[i];
+    if (diff != 0) {
+      return (a_bytes[i] & diff & -diff) != 0; // Lowest differing bit
+    }
+  }
+  return false;
+}
+
+static int cascade_uid(const virtual_card_t *card, uint8_t *bytes) {
+  if (card->uid_length == UID_SIZE_NTAG) {
+    bytes[0] = 0x88; // Cascade tag
+    memcpy(&bytes[1], card->uid, UID_SIZE_NTAG);
+    return UID_SIZE_NTAG + 1;
+  }
+  memcpy(bytes, card->uid, card->uid_length);
+  return card->uid_length;
+}
+
+// Card of target Tg, or NULL if there is no such target or it left the field
+static virtual_card_t *target_card(chip_state_t *chip, uint8_t tg) {
+  if (tg < 1 || tg > chip->target_count || chip->targets[tg - 1] < 0) {
+    return NULL;
+  }
+  return &chip->cards[chip->targets[tg - 1]];
+}
+
+// Performance counters. The bus callbacks only bump counters; the
+// summary is printed every stats_period_ms, whatever the log level.
+
+// Every runtime attribute read goes through here so it can be counted
+static uint32_t read_attr(chip_state_t *chip, uint32_t attr) {
+  STATS_ADD(chip, attr_reads, 1);
+  return attr_read(attr);
+}
+
+#if PN532_STATS
+static void stats_record_latency(chip_state_t *chip, uint64_t latency_ns) {
+  uint64_t latency_us = latency_ns / 1000;
+  int bucket = 0;
+  
+  while (bucket < STATS_LATENCY_BUCKETS - 1 && latency_us >= (1u << bucket)) {
+    bucket++;
+  }
+  STATS_ADD(chip, latency[bucket], 1);
+}
+#endif
+
+static void on_stats_timer(void *user_data) {
+  dump_stats((chip_state_t *)user_data);
+}
+
+static void dump_stats(chip_state_t *chip) {
+  chip_stats_t *stats = &chip->stats;
+  
+  printf("PN532 stats at %llu us: %u bytes in, %u bytes out, %u frames, %u checksum errors, %u attr reads\n",
+         (unsigned long long)(get_sim_nanos() / 1000), stats->bytes_in, stats->bytes_out,
+         stats->frames, stats->checksum_errors, stats->attr_reads);
+  
+  printf("  commands:");
+  for (int i = 0; i < 256; i++) {
+    if (stats->commands[i] > 0) {
+      printf(" %02X=%u", i, stats->commands[i]);
+    }
+  }
+  printf("\n  latency:");
+  for (int i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+    if (stats->latency[i] > 0) {
+      if (i < STATS_LATENCY_BUCKETS - 1) {
+        printf(" <%uus=%u", 1u << i, stats->latency[i]);
+      } else {
+        printf(" >=%uus=%u", 1u << (i - 1), stats->latency[i]);
+      }
+    }
+  }
+  printf("\n");
+}
+
+// Card presence timeline (timeline attribute). PN532_TIMELINE_FILE lists
+// one event per line, in time order:
+//   <time> place <UID hex>   put the card with this UID in the field
+//   <time> remove <UID hex>  take it out again
+//   <time> clear             empty the field
+// Times are simulation time in ns, or with an us / ms / s suffix. Unknown
+// UIDs get a new card. The file is read one event ahead and timeline_timer
+// is started once per event, so a long timeline costs nothing in between.
+
+static void open_timeline(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_TIMELINE_FILE);
+  chip->timeline = fopen(path, "r");
+  if (chip->timeline == NULL) {
+    LOG_ERROR(chip, "Cannot open %s\n", path);
+    return;
+  }
+  if (read_timeline_event(chip)) {
+    schedule_timeline_event(chip);
+  }
+}
+
+static void on_timeline_timer(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  uint64_t now = get_sim_nanos();
+  bool more;
+  
+  // Apply every event that is due, then wait for the next one
+  do {
+    apply_timeline_event(chip);
+    more = read_timeline_event(chip);
+  } while (more && chip->timeline_event.time_ns <= now);
+  if (more) {
+    schedule_timeline_event(chip);
+  }
+  
+  field_changed(chip);
+}
+
+static void schedule_timeline_event(chip_state_t *chip) {
+  uint64_t now = get_sim_nanos();
+  uint64_t time_ns = chip->timeline_event.time_ns;
+  
+  timer_start_ns(chip->timeline_timer, time_ns > now ? time_ns - now : 0, false);
+}
+
+// Parse the next event into chip->timeline_event; false at the end of the file
+static bool read_timeline_event(chip_state_t *chip) {
+  timeline_event_t *event = &chip->timeline_event;
+  char line[128];
+  
+  while (chip->timeline != NULL && fgets(line, sizeof(line), chip->timeline) != NULL) {
+    char *text = line;
+    char *end;
+    uint64_t time_ns = strtoull(text, &end, 10);
+    
+    if (end == text) {
+      continue; // Comment or blank line
+    }
+    text = end;
+    if (strncmp(text, "ns", 2) == 0) {
+      text += 2;
+    } else if (strncmp(text, "us", 2) == 0) {
+      time_ns *= 1000;
+      text += 2;
+    } else if (strncmp(text, "ms", 2) == 0) {
+      time_ns *= 1000000;
+      text += 2;
+    } else if (*text == 's') {
+      time_ns *= 1000000000;
+      text++;
+    }
+    while (*text == ' ' || *text == '\t') {
+      text++;
+    }
+    
+    event->time_ns = time_ns;
+    if (strncmp(text, "clear", 5) == 0) {
+      event->action = TIMELINE_CLEAR;
+      return true;
+    }
+    if (strncmp(text, "place", 5) == 0 || strncmp(text, "remove", 6) == 0) {
+      uint8_t uid[sizeof(event->uid) + 1]; // One spare byte catches overlong UIDs
+      int uid_length;
+      
+      event->action = (text[0] == 'p') ? TIMELINE_PLACE : TIMELINE_REMOVE;
+      uid_length = parse_hex(text + (text[0] == 'p' ? 5 : 6), uid, sizeof(uid));
+      if (uid_length == UID_SIZE_MIFARE_CLASSIC || uid_length == UID_SIZE_NTAG) {
+        memcpy(event->uid, uid, uid_length);
+        event->uid_length = uid_length;
+        return true;
+      }
+    }
+    LOG_ERROR(chip, "Skipping timeline line: %s", line);
+  }
+  
+  if (chip->timeline != NULL) {
+    fclose(chip->timeline);
+    chip->timeline = NULL;
+    LOG_INFO(chip, "Timeline finished\n");
+  }
+  return false;
+}
+
+static void apply_timeline_event(chip_state_t *chip) {
+  timeline_event_t *event = &chip->timeline_event;
+  int index;
+  
+  if (event->action == TIMELINE_CLEAR) {
+    clear_card_field(chip);
+    return;
+  }
+  
+  index = find_card_by_uid(chip, event->uid, event->uid_length);
+  if (event->action == TIMELINE_REMOVE) {
+    if (index >= 0) {
+      remove_card(chip, index);
+    }
+    return;
+  }
+  if (index < 0) {
+    index = add_card_with_uid(chip, event->uid, event->uid_length);
+  }
+  if (index >= 0) {
+    place_card(chip, index);
+  }
+}
+
+// New registry card for a UID the timeline mentions. Its type follows the
+// card_type attribute when the UID length fits, else Classic 1K or NTAG215.
+static int add_card_with_uid(chip_state_t *chip, const uint8_t *uid, uint8_t uid_length) {
+  virtual_card_t *card;
+  int index;
+  
+  if (chip->card_count >= MAX_CARD_COUNT) {
+    LOG_ERROR(chip, "Card registry is full\n");
+    return -1;
+  }
+  index = add_card(chip);
+  card = &chip->cards[index];
+  if (card_type_of(card)->uid_length != uid_length) {
+    card->card_type = (uid_length == UID_SIZE_NTAG) ? CARD_TYPE_NTAG215 : CARD_TYPE_MIFARE_CLASSIC;
+  }
+  memset(card->uid, 0, sizeof(card->uid));
+  memcpy(card->uid, uid, uid_length);
+  card->uid_length = uid_length;
+  
+  // Keep the UID index at most half full
+  if (chip->card_count * 2u > chip->uid_index_mask + 1) {
+    build_uid_index(chip);
+  } else {
+    register_card_uid(chip, index);
+  }
+  return index;
+}
+
+// Command handlers. process_command() has already stored the response code
+// (command + 1) in response_data[0]; handlers fill in the rest.
+
+static void handle_get_firmware_version(chip_state_t *chip) {
+  chip->response_data[1] = 0x32; // IC version: PN532
+  chip->response_data[2] = 0x01; // Firmware version 1
+  chip->response_data[3] = 0x06; // Firmware revision 6
+  chip->response_data[4] = 0x07; // Various capabilities
+  chip->response_length = 5;
+  
+  LOG_TRACE(chip, "Responded with firmware version: PN532 v1.6\n");
+}
+
+static void handle_sam_configuration(chip_state_t *chip) {
+  chip->response_data[1] = 0x00; // Status OK
+  chip->response_length = 2;
+  
+  LOG_TRACE(chip, "Configured SAM\n");
+}
+
+// Select up to max_targets (at most PN532_MAX_TARGETS) cards from the field
+// in anticollision order and number them Tg 1, 2, ...
+static void select_targets(chip_state_t *chip, uint8_t max_targets) {
+  bool listed[MAX_FIELD_CARDS] = {false};
+  
+  if (max_targets > PN532_MAX_TARGETS) {
+    max_targets = PN532_MAX_TARGETS;
+  }
+  
+  chip->target_count = 0;
+  while (chip->target_count < max_targets) {
+    int best = -1;
+    
+    for (int i = 0; i < chip->field_count; i++) {
+      if (!listed[i] && (best < 0 || anticollision_wins(&chip->cards[chip->field_cards[i]],
+                                                         &chip->cards[chip->field_cards[best]]))) {
+        best = i;
+      }
+    }
+    if (best < 0) {
+      break;
+    }
+    listed[best] = true;
+    
+    virtual_card_t *card = &chip->cards[chip->field_cards[best]];
+    chip->targets[chip->target_count++] = chip->field_cards[best];
+    card->auth_sector = -1; // Selecting the card drops its authentication
+    
+    char uid_text[3 * sizeof(card->uid)];
+    LOG_TRACE(chip, "%s found as target %d - UID: %s\n", card_type_of(card)->name, chip->target_count,
+              format_hex(uid_text, card->uid, card->uid_length));
+  }
+  chip->current_target = 1;
+}
+
+// Target data of a 106 kbps type A target: Tg, SENS_RES, SEL_RES, NFCID
+// length and NFCID. Returns its length.
+static int write_target_data(chip_state_t *chip, uint8_t tg, uint8_t *data) {
+  virtual_card_t *card = target_card(chip, tg);
+  const card_type_t *type = card_type_of(card);
+  
+  data[0] = tg; // Target number
+  data[1] = type->atqa[0]; // SENS_RES (ATQA)
+  data[2] = type->atqa[1];
+  data[3] = type->sak; // SEL_RES (SAK)
+  data[4] = card->uid_length; // NFCID length
+  memcpy(&data[5], card->uid, card->uid_length);
+  return 5 + card->uid_length;
+}
+
+static void handle_in_list_passive_target(chip_state_t *chip) {
+  uint8_t max_targets = chip->command_data[1];
+  uint8_t card_baud_rate = chip->command_data[2];
+  uint8_t retries = chip->passive_activation_retries;
+  
+  chip->response_data[1] = 0x00; // No targets found
+  chip->response_length = 2;
+  if (max_targets < 1 || max_targets > PN532_MAX_TARGETS) {
+    // MaxTg 0 would hold until a card shows up and then select none of them
+    LOG_ERROR(chip, "InListPassiveTarget: MaxTg %u out of range\n", max_targets);
+    chip->command_rejected = true;
+    return;
+  }
+  if (card_baud_rate != 0) { // Only Mifare cards (ISO/IEC 14443A, 106 kbps)
+    LOG_ERROR(chip, "Unsupported card type requested\n");
+    return;
+  }
+  
+  select_targets(chip, max_targets);
+  if (chip->target_count == 0) {
+    // Keep trying while MxRtyPassiveActivation allows; one last attempt
+    // after the retries have run out
+    if (retries != 0 && !chip->poll_timed_out) {
+      hold_command(chip, retries == PN532_RETRIES_FOREVER ? 0 :
+                   (uint64_t)retries * LATENCY_INLISTPASSIVETARGET_TIMEOUT_NS);
+      return;
+    }
+    chip->response_latency_ns = LATENCY_INLISTPASSIVETARGET_TIMEOUT_NS;
+    LOG_TRACE(chip, "No card found in field\n");
+    return;
+  }
+  
+  chip->response_data[1] = chip->target_count; // Number of targets found
+  for (int tg = 1; tg <= chip->target_count; tg++) {
+    chip->response_length += write_target_data(chip, tg, &chip->response_data[chip->response_length]);
+  }
+  chip->response_latency_ns += (chip->target_count - 1) * LATENCY_INLISTPASSIVETARGET_NS;
+}
+
+// InAutoPoll: poll PollNr times (0xFF = until a card arrives) for the listed
+// target types, waiting Period x 150 ms per type
+static void handle_in_auto_poll(chip_state_t *chip) {
+  uint8_t poll_count = chip->command_data[1];
+  uint8_t period = chip->command_data[2];
+  int type_count = chip->command_length - 3;
+  int type = -1;
+  
+  chip->response_data[1] = 0x00; // No targets found
+  chip->response_length = 2;
+  
+  for (int i = 0; i < type_count && type < 0; i++) {
+    uint8_t requested = chip->command_data[3 + i];
+    if (requested == AUTOPOLL_TYPE_GENERIC_106 || requested == AUTOPOLL_TYPE_MIFARE) {
+      type = requested;
+    }
+  }
+  if (type < 0) {
+    chip->response_latency_ns = LATENCY_INLISTPASSIVETARGET_TIMEOUT_NS;
+    LOG_ERROR(chip, "InAutoPoll: none of the requested target types is emulated\n");
+    return;
+  }
+  
+  select_targets(chip, PN532_MAX_TARGETS);
+  if (chip->target_count == 0) {
+    uint64_t poll_ns = (uint64_t)poll_count * type_count * period * AUTOPOLL_PERIOD_NS;
+    
+    // hold_command() treats 0 as "forever", so a PollNr or Period of zero
+    // gets the single attempt's answer straight away
+    if (chip->poll_timed_out) {
+      chip->response_latency_ns = 0; // The polling time has already passed
+    } else if (poll_count == PN532_RETRIES_FOREVER || poll_ns != 0) {
+      hold_command(chip, poll_count == PN532_RETRIES_FOREVER ? 0 : poll_ns);
+      return;
+    }
+    LOG_TRACE(chip, "InAutoPoll found no card\n");
+    return;
+  }
+  
+  chip->response_data[1] = chip->target_count; // Number of targets found
+  for (int tg = 1; tg <= chip->target_count; tg++) {
+    uint8_t *entry = &chip->response_data[chip->response_length];
+    entry[0] = type; // Type of the target
+    entry[1] = write_target_data(chip, tg, &entry[2]); // Length of its data
+    chip->response_length += 2 + entry[1];
+  }
+  chip->response_latency_ns += (chip->target_count - 1) * LATENCY_INLISTPASSIVETARGET_NS;
+}
+
+// RFConfiguration: only the retry counts are emulated, other items are accepted
+static void handle_rf_configuration(chip_state_t *chip) {
+  uint8_t item = chip->command_data[1];
+  
+  if (item == RFCONFIG_ITEM_MAX_RETRIES && chip->command_length >= 5) {
+    chip->passive_activation_retries = chip->command_data[4]; // After MxRtyATR and MxRtyPSL
+    LOG_TRACE(chip, "MxRtyPassiveActivation set to %u\n", chip->passive_activation_retries);
+  }
+}
+
+// PowerDown: [0x16, WakeUpEnable, GenerateIRQ (optional)]. The chip powers
+// down once the host has read this response.
+static void handle_power_down(chip_state_t *chip) {
+  chip->wakeup_enable = chip->command_data[1];
+  chip->wakeup_generate_irq = chip->command_length > 2 && (chip->command_data[2] & 0x01);
+  running_response(chip)->power_down = true;
+  
+  chip->response_data[1] = 0x00; // Status OK
+  chip->response_length = 2;
+}
+
+static void handle_in_data_exchange(chip_state_t *chip) {
+  // command_data: [0x40, Tg, card command...]; bit 6 of Tg is the MI (more information) flag
+  uint8_t tg = chip->command_data[1] & 0x3F;
+  
+  chip->current_target = tg;
+  card_exchange(chip, target_card(chip, tg), &chip->command_data[2], chip->command_length - 2);
+}
+
+static void handle_in_communicate_thru(chip_state_t *chip) {
+  // command_data: [0x42, card command...]; no target number, goes to the current target
+  card_exchange(chip, target_card(chip, chip->current_target),
+                &chip->command_data[1], chip->command_length - 1);
+}
+
+// InRelease / InSelect: status byte only. Tg 0 releases every target.
+static void handle_in_release(chip_state_t *chip) {
+  uint8_t tg = chip->command_data[1];
+  
+  chip->response_length = 2;
+  if (tg == 0) {
+    chip->target_count = 0;
+  } else if (target_card(chip, tg) != NULL) {
+    chip->targets[tg - 1] = -1;
+  } else {
+    chip->response_data[1] = PN532_ERROR_WRONG_TARGET;
+    return;
+  }
+  chip->response_data[1] = 0x00; // Status OK
+  LOG_TRACE(chip, "Released target %d\n", tg);
+}
+
+static void handle_in_select(chip_state_t *chip) {
+  uint8_t tg = chip->command_data[1];
+  virtual_card_t *card = target_card(chip, tg);
+  
+  chip->response_length = 2;
+  if (card == NULL) {
+    chip->response_data[1] = PN532_ERROR_WRONG_TARGET;
+    return;
+  }
+  chip->current_target = tg;
+  card->auth_sector = -1;
+  chip->response_data[1] = 0x00; // Status OK
+}
+
+// Route a card command (Mifare command byte + parameters) to a target card,
+// through the command table of its type
+static void card_exchange(chip_state_t *chip, virtual_card_t *card, const uint8_t *data, uint16_t length) {
+  const mifare_command_entry_t *entry;
+  
+  // Make sure the target is still in the field
+  if (card == NULL || length < 1) {
+    chip->response_data[1] = 0x01; // Error (timeout)
+    chip->response_length = 2;
+    LOG_INFO(chip, "No card in field for data exchange\n");
+    return;
+  }
+  
+  entry = &card_type_of(card)->commands[data[0]];
+  if (entry->handler == NULL || length < entry->min_length) {
+    chip->response_data[1] = 0x01; // Error
+    chip->response_length = 2;
+    LOG_ERROR(chip, "Unsupported %s command: 0x%02X\n", card_type_of(card)->name, data[0]);
+    return;
+  }
+  
+  chip->response_latency_ns += entry->latency_ns;
+  entry->handler(chip, card, data, length);
+}
+
+// Mifare Classic commands. data[0] is the Mifare command byte. Each card
+// keeps the sector and key it last authenticated with until it is selected
+// again; READ and WRITE then only need its decoded access conditions.
+
+static void mifare_authenticate(chip_state_t *chip, virtual_card_t *card,
+                                const uint8_t *data, uint16_t length) {
+  uint8_t key_type = data[0];
+  uint8_t block_number = data[1];
+  const uint8_t *key = &data[2]; // 6-byte key
+  int sector = classic_sector(block_number);
+  
+  chip->response_length = 2;
+  if (block_number < card_type_of(card)->block_count &&
+      authenticate_sector(chip, card, sector, key_type, key)) {
+    card->auth_sector = sector;
+    card->auth_key_type = key_type;
+    memcpy(card->auth_key, key, MIFARE_KEY_SIZE);
+    chip->response_data[1] = 0x00; // Authentication successful
+    LOG_TRACE(chip, "Authentication successful for sector %d\n", sector);
+  } else {
+    card->auth_sector = -1; // A failed authentication halts the card
+    chip->response_data[1] = 0x01; // Authentication failed
+    LOG_INFO(chip, "Authentication failed for sector %d\n", sector);
+  }
+}
+
+// READ returns one block. As a vendor extension an optional third byte asks
+// for that many consecutive blocks in one response; sectors past the
+// authenticated one are re-authenticated with the same key.
+static void mifare_read(chip_state_t *chip, virtual_card_t *card,
+                        const uint8_t *data, uint16_t length) {
+  uint8_t block_number = data[1];
+  uint8_t block_count = (length > 2) ? data[2] : 1;
+  int sector = classic_sector(block_number);
+  bool key_b = card->auth_key_type == MIFARE_CMD_AUTH_B;
+  
+  chip->response_length = 2;
+  if (block_count == 0 || block_count > MIFARE_READ_MAX_BLOCKS ||
+      block_number + block_count > card_type_of(card)->block_count) {
+    chip->response_data[1] = 0x01; // Error
+    LOG_ERROR(chip, "Invalid read of %d blocks from block %d\n", block_count, block_number);
+    return;
+  }
+  
+  // Check authentication
+  for (int s = sector; s <= classic_sector(block_number + block_count - 1); s++) {
+    if (s != card->auth_sector &&
+        (s == sector || !authenticate_sector(chip, card, s, card->auth_key_type, card->auth_key))) {
+      chip->response_data[1] = 0x01; // Authentication required
+      LOG_INFO(chip, "Authentication required for sector %d\n", s);
+      return;
+    }
+  }
+  
+  // Check access conditions
+  for (int block = block_number; block < block_number + block_count; block++) {
+    int group = classic_block_group(block);
+    
+    if (group != MIFARE_CLASSIC_TRAILER_GROUP &&
+        !access_allows(card_access(card, classic_sector(block)), ACCESS_DATA_READ(group), key_b)) {
+      chip->response_data[1] = 0x01; // Access denied
+      LOG_INFO(chip, "Read of block %d denied by its access conditions\n", block);
+      return;
+    }
+  }
+  
+  // Data blocks go out straight from card memory; trailers are masked in
+  // their own slot of response_data
+  for (int i = 0; i < block_count; i++) {
+    int block = block_number + i;
+    
+    if (classic_block_group(block) == MIFARE_CLASSIC_TRAILER_GROUP) {
+      uint32_t access = card_access(card, classic_sector(block));
+      uint8_t *dest = &chip->response_data[2 + i * MIFARE_CLASSIC_BLOCK_SIZE];
+      
+      memcpy(dest, card_data(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE), MIFARE_CLASSIC_BLOCK_SIZE);
+      // Key A never reads back; the access bits and key B only when allowed
+      memset(&dest[0], 0, MIFARE_KEY_SIZE);
+      if (!access_allows(access, ACCESS_BITS_READ, key_b)) {
+        memset(&dest[6], 0, 4);
+      }
+      if (!access_allows(access, ACCESS_KEY_B_READ, key_b)) {
+        memset(&dest[10], 0, MIFARE_KEY_SIZE);
+      }
+      respond_bytes(chip, dest, MIFARE_CLASSIC_BLOCK_SIZE, byte_sum(dest, MIFARE_CLASSIC_BLOCK_SIZE));
+    } else {
+      respond_card_data(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE, MIFARE_CLASSIC_BLOCK_SIZE);
+    }
+  }
+  
+  chip->response_data[1] = 0x00; // Status OK
+  chip->response_latency_ns += (block_count - 1) * LATENCY_MIFARE_READ_NS;
+  
+  LOG_TRACE(chip, "Read %d block(s) from block %d in sector %d\n", block_count, block_number, sector);
+}
+
+static void mifare_write(chip_state_t *chip, virtual_card_t *card,
+                         const uint8_t *data, uint16_t length) {
+  uint8_t block_number = data[1];
+  int sector = classic_sector(block_number);
+  int group = classic_block_group(block_number);
+  bool key_b = card->auth_key_type == MIFARE_CMD_AUTH_B;
+  bool written;
+  
+  chip->response_data[1] = 0x01; // Error unless written below
+  chip->response_length = 2;
+  
+  if (block_number == 0 || block_number >= card_type_of(card)->block_count) {
+    LOG_ERROR(chip, "Invalid write to block %d\n", block_number);
+    return;
+  }
+  
+  // Check authentication
+  if (sector != card->auth_sector) {
+    LOG_INFO(chip, "Authentication required for sector %d\n", sector);
+    return;
+  }
+  
+  if (group == MIFARE_CLASSIC_TRAILER_GROUP) {
+    written = mifare_write_trailer(chip, card, sector, key_b, &data[2]);
+  } else {
+    written = access_allows(card_access(card, sector), ACCESS_DATA_WRITE(group), key_b);
+    if (written) {
+      memcpy(card_data_for_write(chip, card, block_number * MIFARE_CLASSIC_BLOCK_SIZE), &data[2],
+             MIFARE_CLASSIC_BLOCK_SIZE);
+    }
+  }
+  if (!written) {
+    LOG_INFO(chip, "Write to block %d denied by its access conditions\n", block_number);
+    return;
+  }
+  journal_append(chip, card, block_number);
+  
+  chip->response_data[1] = 0x00; // Status OK
+  LOG_TRACE(chip, "Wrote block %d in sector %d\n", block_number, sector);
+}
+
+// A trailer write only changes the fields the access conditions let this key
+// write. New access bits must be valid, as a card with broken access bits
+// would lock the sector for good.
+static bool mifare_write_trailer(chip_state_t *chip, virtual_card_t *card, int sector,
+                                 bool key_b, const uint8_t *data) {
+  int block = classic_sector_trailer(sector);
+  uint32_t access = card_access(card, sector);
+  uint8_t trailer[MIFARE_CLASSIC_BLOCK_SIZE];
+  bool written = false;
+  
+  memcpy(trailer, card_data(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE), MIFARE_CLASSIC_BLOCK_SIZE);
+  if (access_allows(access, ACCESS_KEY_A_WRITE, key_b)) {
+    memcpy(&trailer[0], &data[0], MIFARE_KEY_SIZE);
+    written = true;
+  }
+  if (access_allows(access, ACCESS_BITS_WRITE, key_b)) {
+    uint32_t new_access;
+    if (!decode_access_bits(&data[6], &new_access)) {
+      LOG_ERROR(chip, "Rejected invalid access bits for sector %d\n", sector);
+      return false;
+    }
+    memcpy(&trailer[6], &data[6], 4); // Access bits and the general purpose byte
+    written = true;
+  }
+  if (access_allows(access, ACCESS_KEY_B_WRITE, key_b)) {
+    memcpy(&trailer[10], &data[10], MIFARE_KEY_SIZE);
+    written = true;
+  }
+  
+  if (written) {
+    memcpy(card_data_for_write(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE), trailer, MIFARE_CLASSIC_BLOCK_SIZE);
+    update_sector_access(chip, card, sector);
+  }
+  return written;
+}
+
+// Vendor extension: WRITE_SECTOR [cmd, block, flags, data blocks, trailer
+// (, master key)] writes every block of the authenticated sector that
+// `block` is in, or none of them. Block 0 (manufacturer data) keeps its
+// contents. The data blocks, and the new trailer's fields and access bits,
+// are all checked against the sector's access conditions before anything
+// is written; the trailer goes last. A 16-block sector leaves no room for a
+// master key in the frame.
+static void mifare_write_sector(chip_state_t *chip, virtual_card_t *card,
+                                const uint8_t *data, uint16_t length) {
+  uint8_t block_number = data[1];
+  uint8_t flags = data[2];
+  const uint8_t *blocks = &data[3];
+  int sector = classic_sector(block_number);
+  int trailer_block = classic_sector_trailer(sector);
+  int first_block = trailer_block + 1 - (sector < MIFARE_CLASSIC_SMALL_SECTORS ?
+                                         MIFARE_CLASSIC_BLOCKS_PER_SECTOR : MIFARE_CLASSIC_LARGE_SECTOR_BLOCKS);
+  int data_length = (trailer_block + 1 - first_block) * MIFARE_CLASSIC_BLOCK_SIZE;
+  bool key_b = card->auth_key_type == MIFARE_CMD_AUTH_B;
+  uint32_t access = card_access(card, sector);
+  uint32_t new_access;
+  uint8_t trailer[MIFARE_CLASSIC_BLOCK_SIZE];
+  uint8_t round_keys[AES_ROUND_KEYS_SIZE]; // New master key, kept only if the write goes through
+  const uint8_t *master_round_keys = chip->master_key_loaded ? chip->master_round_keys : NULL;
+  int written = 0;
+  
+  chip->response_data[1] = 0x01; // Error unless written below
+  chip->response_length = 2;
+  
+  if (block_number >= card_type_of(card)->block_count ||
+      length != 3 + data_length + ((flags & WRITE_SECTOR_LOAD_MASTER_KEY) ? AES_BLOCK_SIZE : 0)) {
+    LOG_ERROR(chip, "Invalid sector write to block %d\n", block_number);
+    return;
+  }
+  
+  // Check authentication
+  if (sector != card->auth_sector) {
+    LOG_INFO(chip, "Authentication required for sector %d\n", sector);
+    return;
+  }
+  
+  if (flags & WRITE_SECTOR_LOAD_MASTER_KEY) {
+    aes128_expand_key(&blocks[data_length], round_keys);
+    master_round_keys = round_keys;
+  }
+  memcpy(trailer, &blocks[data_length - MIFARE_CLASSIC_BLOCK_SIZE], MIFARE_CLASSIC_BLOCK_SIZE);
+  if (flags & (WRITE_SECTOR_DIVERSIFY_KEY_A | WRITE_SECTOR_DIVERSIFY_KEY_B)) {
+    if (master_round_keys == NULL) {
+      LOG_ERROR(chip, "No master key for key diversification\n");
+      return;
+    }
+    if (flags & WRITE_SECTOR_DIVERSIFY_KEY_A) {
+      diversify_key(master_round_keys, card, sector, MIFARE_CMD_AUTH_A, &trailer[0]);
+    }
+    if (flags & WRITE_SECTOR_DIVERSIFY_KEY_B) {
+      diversify_key(master_round_keys, card, sector, MIFARE_CMD_AUTH_B, &trailer[10]);
+    }
+  }
+  
+  // Check access conditions, for the whole sector before any write
+  for (int block = first_block; block < trailer_block; block++) {
+    if (block > 0 && !access_allows(access, ACCESS_DATA_WRITE(classic_block_group(block)), key_b)) {
+      LOG_INFO(chip, "Write to block %d denied by its access conditions\n", block);
+      return;
+    }
+  }
+  if (!access_allows(access, ACCESS_KEY_A_WRITE, key_b) && !access_allows(access, ACCESS_BITS_WRITE, key_b) &&
+      !access_allows(access, ACCESS_KEY_B_WRITE, key_b)) {
+    LOG_INFO(chip, "Write to block %d denied by its access conditions\n", trailer_block);
+    return;
+  }
+  if (access_allows(access, ACCESS_BITS_WRITE, key_b) && !decode_access_bits(&trailer[6], &new_access)) {
+    LOG_ERROR(chip, "Rejected invalid access bits for sector %d\n", sector);
+    return;
+  }
+  
+  // Every check passed: the new master key (if any) replaces the old one
+  if (flags & WRITE_SECTOR_LOAD_MASTER_KEY) {
+    memcpy(chip->master_round_keys, round_keys, AES_ROUND_KEYS_SIZE);
+    chip->master_key_loaded = true;
+  }
+  for (int block = first_block; block < trailer_block; block++) {
+    if (block > 0) {
+      memcpy(card_data_for_write(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE),
+             &blocks[(block - first_block) * MIFARE_CLASSIC_BLOCK_SIZE], MIFARE_CLASSIC_BLOCK_SIZE);
+      journal_append(chip, card, block);
+      written++;
+    }
+  }
+  mifare_write_trailer(chip, card, sector, key_b, trailer);
+  journal_append(chip, card, trailer_block);
+  written++;
+  
+  chip->response_data[1] = 0x00; // Status OK
+  chip->response_latency_ns += (written - 1) * LATENCY_MIFARE_WRITE_NS;
+  LOG_TRACE(chip, "Wrote %d blocks of sector %d\n", written, sector);
+}
+
+// Key diversification. A card key is the first six bytes of the AES-CMAC,
+// under the master key, of KEY_DIVERSIFICATION_CONSTANT, the UID, the sector
+// number and the key type (MIFARE_CMD_AUTH_A / _B), so a host with the
+// master key can recompute any card's keys.
+
+static void diversify_key(const uint8_t *round_keys, virtual_card_t *card, int sector, uint8_t key_type, uint8_t *key) {
+  uint8_t input[3 + sizeof(card->uid)];
+  uint8_t mac[AES_BLOCK_SIZE];
+  int length = 0;
+  
+  input[length++] = KEY_DIVERSIFICATION_CONSTANT;
+  memcpy(&input[length], card->uid, card->uid_length);
+  length += card->uid_length;
+  input[length++] = sector;
+  input[length++] = key_type;
+  
+  aes_cmac(round_keys, input, length, mac);
+  memcpy(key, mac, MIFARE_KEY_SIZE);
+}
+
+static const uint8_t aes_sbox[256] = {
+  0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+  0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+  0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+  0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+  0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+  0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+  0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+  0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+  0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+  0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+  0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+  0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+  0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+  0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+  0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+  0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
+
+// Multiply by x in GF(2^8)
+static uint8_t aes_xtime(uint8_t value) {
+  return (value << 1) ^ ((value & 0x80) ? 0x1B : 0x00);
+}
+
+static void aes128_expand_key(const uint8_t *key, uint8_t *round_keys) {
+  uint8_t rcon = 0x01;
+  
+  memcpy(round_keys, key, AES_BLOCK_SIZE);
+  for (int i = AES_BLOCK_SIZE; i < AES_ROUND_KEYS_SIZE; i += 4) {
+    uint8_t word[4];
+    
+    memcpy(word, &round_keys[i - 4], 4);
+    if (i % AES_BLOCK_SIZE == 0) {
+      // RotWord, SubWord and the round constant
+      uint8_t first = word[0];
+      word[0] = aes_sbox[word[1]] ^ rcon;
+      word[1] = aes_sbox[word[2]];
+      word[2] = aes_sbox[word[3]];
+      word[3] = aes_sbox[first];
+      rcon = aes_xtime(rcon);
+    }
+    for (int j = 0; j < 4; j++) {
+      round_keys[i + j] = round_keys[i - AES_BLOCK_SIZE + j] ^ word[j];
+    }
+  }
+}
+
+static void aes128_encrypt(const uint8_t *round_keys, const uint8_t *in, uint8_t *out) {
+  uint8_t state[AES_BLOCK_SIZE];
+  
+  for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+    state[i] = in[i] ^ round_keys[i];
+  }
+  for (int round = 1; round <= AES_ROUNDS; round++) {
+    uint8_t shifted[AES_BLOCK_SIZE];
+    
+    // SubBytes and ShiftRows: row r of column c comes from column c + r
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 4; r++) {
+        shifted[c * 4 + r] = aes_sbox[state[((c + r) % 4) * 4 + r]];
+      }
+    }
+    // MixColumns, except in the last round
+    for (int c = 0; c < 4; c++) {
+      uint8_t *column = &shifted[c * 4];
+      if (round < AES_ROUNDS) {
+        uint8_t all = column[0] ^ column[1] ^ column[2] ^ column[3];
+        uint8_t first = column[0];
+        column[0] ^= all ^ aes_xtime(column[0] ^ column[1]);
+        column[1] ^= all ^ aes_xtime(column[1] ^ column[2]);
+        column[2] ^= all ^ aes_xtime(column[2] ^ column[3]);
+        column[3] ^= all ^ aes_xtime(column[3] ^ first);
+      }
+      for (int r = 0; r < 4; r++) {
+        state[c * 4 + r] = column[r] ^ round_keys[round * AES_BLOCK_SIZE + c * 4 + r];
+      }
+    }
+  }
+  memcpy(out, state, AES_BLOCK_SIZE);
+}
+
+// Shift a block left by one bit, folding the carry back in with R_128
+static void cmac_subkey(const uint8_t *in, uint8_t *out) {
+  uint8_t carry = in[0] & 0x80;
+  
+  for (int i = 0; i < AES_BLOCK_SIZE - 1; i++) {
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[AES_BLOCK_SIZE - 1] = (in[AES_BLOCK_SIZE - 1] << 1) ^ (carry ? 0x87 : 0x00);
+}
+
+static void aes_cmac(const uint8_t *round_keys, const uint8_t *message, int length, uint8_t *mac) {
+  static const uint8_t zero[AES_BLOCK_SIZE];
+  uint8_t subkey[AES_BLOCK_SIZE];
+  uint8_t last[AES_BLOCK_SIZE];
+  int blocks = (length + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+  bool complete = length > 0 && length % AES_BLOCK_SIZE == 0;
+  
+  // K1 for a complete last block, K2 for a padded one
+  aes128_encrypt(round_keys, zero, subkey);
+  cmac_subkey(subkey, subkey);
+  if (!complete) {
+    cmac_subkey(subkey, subkey);
+    blocks = blocks > 0 ? blocks : 1;
+  }
+  
+  memset(last, 0, AES_BLOCK_SIZE);
+  memcpy(last, &message[(blocks - 1) * AES_BLOCK_SIZE], length - (blocks - 1) * AES_BLOCK_SIZE);
+  if (!complete) {
+    last[length - (blocks - 1) * AES_BLOCK_SIZE] = 0x80;
+  }
+  
+  memset(mac, 0, AES_BLOCK_SIZE);
+  for (int b = 0; b < blocks; b++) {
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) {
+      mac[i] ^= (b == blocks - 1) ? last[i] ^ subkey[i] : message[b * AES_BLOCK_SIZE + i];
+    }
+    aes128_encrypt(round_keys, mac, mac);
+  }
+}
+
+// Access conditions. The C1/C2/C3 bits of a trailer are decoded once into
+// a permission bitmap when the trailer is loaded or written, indexed by the
+// sector's data block groups and trailer fields; bit (field + 1) is the key
+// B permission of the key A bit at field.
+
+// Permissions for each C1C2C3 code: bit 0 key A, bit 1 key B
+static const uint8_t data_read_access[8] = {3, 3, 3, 2, 3, 2, 3, 0}; // 000, 001, 010, ...
+static const uint8_t data_write_access[8] = {3, 0, 0, 2, 2, 0, 2, 0};
+static const uint8_t trailer_access[8][5] = {
+  // Key A write, access bits read, access bits write, key B read, key B write
+  {1, 1, 0, 1, 1}, // 000
+  {1, 1, 1, 1, 1}, // 001 (transport configuration)
+  {0, 1, 0, 1, 0}, // 010
+  {2, 3, 2, 0, 2}, // 011
+  {2, 3, 0, 0, 2}, // 100
+  {0, 3, 2, 0, 0}, // 101
+  {0, 3, 0, 0, 0}, // 110
+  {0, 3, 0, 0, 0}, // 111
+};
+
+// Decode access bytes 6-8 of a trailer; false when they contradict their
+// inverted copies
+static bool decode_access_bits(const uint8_t *bits, uint32_t *access) {
+  uint8_t c1 = bits[1] >> 4;
+  uint8_t c2 = bits[2] & 0x0F;
+  uint8_t c3 = bits[2] >> 4;
+  uint32_t result = 0;
+  
+  if ((bits[0] & 0x0F) != (~c1 & 0x0F) || (bits[0] >> 4) != (~c2 & 0x0F) ||
+      (bits[1] & 0x0F) != (~c3 & 0x0F)) {
+    return false;
+  }
+  
+  for (int group = 0; group < MIFARE_CLASSIC_TRAILER_GROUP; group++) {
+    int code = ((c1 >> group) & 1) << 2 | ((c2 >> group) & 1) << 1 | ((c3 >> group) & 1);
+    result |= (uint32_t)data_read_access[code] << ACCESS_DATA_READ(group);
+    result |= (uint32_t)data_write_access[code] << ACCESS_DATA_WRITE(group);
+  }
+  
+  int code = ((c1 >> 3) & 1) << 2 | ((c2 >> 3) & 1) << 1 | ((c3 >> 3) & 1);
+  for (int field = 0; field < 5; field++) {
+    result |= (uint32_t)trailer_access[code][field] << (ACCESS_KEY_A_WRITE + field * 2);
+  }
+  
+  // Key B cannot be used while it is readable
+  if (access_allows(result, ACCESS_KEY_B_READ, false)) {
+    result &= ~ACCESS_KEY_B_MASK;
+  }
+  
+  *access = result;
+  return true;
+}
+
+static bool access_allows(uint32_t access, int field, bool key_b) {
+  return (access >> (field + (key_b ? 1 : 0))) & 1;
+}
+
+static uint32_t card_access(const virtual_card_t *card, int sector) {
+  return card->access != NULL ? card->access[sector] : ACCESS_TRANSPORT;
+}
+
+// Decode a sector's trailer as it is now in card memory. A sector with
+// invalid access bits (from a dump) can no longer be read or written.
+static void update_sector_access(chip_state_t *chip, virtual_card_t *card, int sector) {
+  int sector_count = card_type_of(card)->sector_count;
+  int block = classic_sector_trailer(sector);
+  
+  if (card->access == NULL) {
+    card->access = malloc(sector_count * sizeof(uint32_t));
+    for (int i = 0; i < sector_count; i++) {
+      card->access[i] = ACCESS_TRANSPORT;
+    }
+  }
+  if (!decode_access_bits(card_data(chip, card, block * MIFARE_CLASSIC_BLOCK_SIZE) + 6, &card->access[sector])) {
+    LOG_ERROR(chip, "Sector %d has invalid access bits and is locked\n", sector);
+    card->access[sector] = 0;
+  }
+}
+
+// Ultralight / NTAG2xx commands. Memory is addressed in 4-byte pages.
+
+static void ntag_get_version(chip_state_t *chip, virtual_card_t *card,
+                             const uint8_t *data, uint16_t length) {
+  const card_type_t *type = card_type_of(card);
+  
+  if (type->version == NULL) {
+    chip->response_data[1] = 0x01; // Not supported by this tag
+    chip->response_length = 2;
+    LOG_ERROR(chip, "%s has no GET_VERSION\n", type->name);
+    return;
+  }
+  chip->response_data[1] = 0x00; // Status OK
+  memcpy(&chip->response_data[2], type->version, NTAG_VERSION_SIZE);
+  chip->response_length = 2 + NTAG_VERSION_SIZE;
+}
+
+// READ returns four pages, rolling over to page 0 past the end of memory
+static void ntag_read(chip_state_t *chip, virtual_card_t *card,
+                      const uint8_t *data, uint16_t length) {
+  const card_type_t *type = card_type_of(card);
+  uint8_t page = data[1];
+  
+  if (page >= type->block_count) {
+    chip->response_data[1] = 0x01; // Error
+    chip->response_length = 2;
+    LOG_ERROR(chip, "Invalid read from page %d\n", page);
+    return;
+  }
+  
+  chip->response_data[1] = 0x00; // Status OK
+  for (int i = 0; i < NTAG_READ_PAGES; i++) {
+    respond_card_data(chip, card, ((page + i) % type->block_count) * NTAG_PAGE_SIZE, NTAG_PAGE_SIZE);
+  }
+  chip->response_length = 2;
+  
+  LOG_TRACE(chip, "Read pages %d-%d\n", page, page + NTAG_READ_PAGES - 1);
+}
+
+// FAST_READ returns pages start..end (inclusive) in one response
+static void ntag_fast_read(chip_state_t *chip, virtual_card_t *card,
+                           const uint8_t *data, uint16_t length) {
+  uint8_t start_page = data[1];
+  uint8_t end_page = data[2];
+  int page_count = end_page - start_page + 1;
+  
+  if (end_page < start_page || end_page >= card_type_of(card)->block_count ||
+      page_count > NTAG_FAST_READ_MAX_PAGES) {
+    chip->response_data[1] = 0x01; // Error
+    chip->response_length = 2;
+    LOG_ERROR(chip, "Invalid fast read of pages %d-%d\n", start_page, end_page);
+    return;
+  }
+  
+  chip->response_data[1] = 0x00; // Status OK
+  respond_card_data(chip, card, start_page * NTAG_PAGE_SIZE, page_count * NTAG_PAGE_SIZE);
+  chip->response_length = 2;
+  chip->response_latency_ns += page_count * LATENCY_NTAG_FAST_READ_PAGE_NS;
+  
+  LOG_TRACE(chip, "Fast read pages %d-%d\n", start_page, end_page);
+}
+
+// WRITE takes one page; COMPATIBILITY_WRITE takes a 16-byte block of which
+// only the first page is written
+static void ntag_write(chip_state_t *chip, virtual_card_t *card,
+                       const uint8_t *data, uint16_t length) {
+  ntag_write_page(chip, card, data[1], &data[2]);
+}
+
+static void ntag_write_page(chip_state_t *chip, virtual_card_t *card, int page, const uint8_t *bytes) {
+  uint8_t *target;
+  
+  chip->response_length = 2;
+  if (page < NTAG_FIRST_WRITABLE_PAGE || page >= card_type_of(card)->block_count) {
+    chip->response_data[1] = 0x01; // Error
+    LOG_ERROR(chip, "Invalid write to page %d\n", page);
+    return;
+  }
+  
+  target = card_data_for_write(chip, card, page * NTAG_PAGE_SIZE);
+  if (page < NTAG_OTP_PAGES) {
+    // Lock bytes and capability container bits can only be set; page 2
+    // starts with the read-only BCC1 and internal bytes
+    for (int i = (page == NTAG_FIRST_WRITABLE_PAGE) ? 2 : 0; i < NTAG_PAGE_SIZE; i++) {
+      target[i] |= bytes[i];
+    }
+  } else {
+    memcpy(target, bytes, NTAG_PAGE_SIZE);
+  }
+  journal_append(chip, card, page * NTAG_PAGE_SIZE / JOURNAL_BLOCK_SIZE);
+  
+  chip->response_data[1] = 0x00; // Status OK
+  LOG_TRACE(chip, "Wrote page %d\n", page);
+}
+
+// Target mode (TgInitAsTarget, TgGetData, TgSetData). The initiator is a
+// script in PN532_PEER_FILE, streamed a line at a time:
+//   > hex      the initiator sends a frame
+//   >+ hex     ... which continues in the next frame (MI chaining)
+//   < hex      the initiator waits for the host's TgSetData (checked against hex)
+//   delay ms   the initiator pauses
+// Lines starting with anything else are comments. Sent frames queue in a
+// ring buffer so the script runs ahead of the host, and TgGetData returns
+// a whole chain at once when it fits in one response.
+
+static void handle_tg_init_as_target(chip_state_t *chip) {
+  uint8_t mode = chip->command_data[1];
+  
+  if (chip->target_mode != TARGET_MODE_WAITING) {
+    start_peer(chip);
+  }
+  if (chip->peer_ring.frame_count == 0) {
+    hold_command(chip, 0); // Until the initiator activates us
+    return;
+  }
+  
+  // Activated: report how, then the initiator's first command
+  chip->target_mode = TARGET_MODE_ACTIVE;
+  chip->response_data[1] = (mode & TG_MODE_PICC_ONLY) ? TG_ACTIVATED_PICC : TG_ACTIVATED_DEP;
+  chip->response_length = 2 + peer_ring_pop(chip, &chip->response_data[2], NULL);
+  peer_advance(chip);
+  LOG_INFO(chip, "Activated as target by the scripted initiator\n");
+}
+
+static void handle_tg_get_data(chip_state_t *chip) {
+  bool more;
+  
+  chip->response_length = 2;
+  if (chip->target_mode != TARGET_MODE_ACTIVE) {
+    chip->response_data[1] = PN532_ERROR_INVALID_STATE;
+    return;
+  }
+  if (chip->peer_ring.frame_count == 0) {
+    if (peer_finished(chip)) {
+      chip->target_mode = TARGET_MODE_OFF;
+      chip->response_data[1] = PN532_ERROR_RELEASED;
+      LOG_INFO(chip, "Scripted initiator released the target\n");
+    } else {
+      hold_command(chip, 0); // Until the initiator sends something
+    }
+    return;
+  }
+  
+  chip->response_length += peer_ring_pop(chip, &chip->response_data[2], &more);
+  chip->response_data[1] = more ? PN532_STATUS_MORE_INFORMATION : 0x00;
+  peer_advance(chip);
+}
+
+static void handle_tg_set_data(chip_state_t *chip) {
+  const uint8_t *data = &chip->command_data[1];
+  uint16_t length = chip->command_length - 1;
+  
+  chip->response_length = 2;
+  if (chip->target_mode != TARGET_MODE_ACTIVE) {
+    chip->response_data[1] = PN532_ERROR_INVALID_STATE;
+    return;
+  }
+  if (peer_finished(chip)) {
+    chip->target_mode = TARGET_MODE_OFF;
+    chip->response_data[1] = PN532_ERROR_RELEASED;
+    return;
+  }
+  
+  if (chip->peer_waiting) {
+    if (length != chip->peer_expected_length || memcmp(data, chip->peer_expected, length) != 0) {
+      LOG_ERROR(chip, "TgSetData differs from the response the initiator script expects\n");
+    }
+    chip->peer_waiting = false;
+    peer_advance(chip);
+  } else {
+    LOG_INFO(chip, "TgSetData while the initiator script is not waiting for a response\n");
+  }
+  chip->response_data[1] = 0x00; // Status OK
+}
+
+// (Re)start the initiator script
+static void start_peer(chip_state_t *chip) {
+  char path[sizeof(PN532_DUMP_DIR) + 32];
+  
+  if (chip->peer != NULL) {
+    fclose(chip->peer);
+  }
+  timer_stop(chip->peer_timer);
+  memset(&chip->peer_ring, 0, sizeof(chip->peer_ring));
+  chip->peer_waiting = false;
+  chip->peer_delayed = false;
+  chip->target_mode = TARGET_MODE_WAITING;
+  
+  snprintf(path, sizeof(path), "%s%s", PN532_DUMP_DIR, PN532_PEER_FILE);
+  chip->peer = fopen(path, "r");
+  if (chip->peer == NULL) {
+    LOG_INFO(chip, "No %s, waiting for an initiator forever\n", path);
+  }
+  peer_advance(chip);
+}
+
+// Run the script until it waits for the host, pauses or fills the ring
+static void peer_advance(chip_state_t *chip) {
+  peer_ring_t *ring = &chip->peer_ring;
+  char line[PEER_LINE_SIZE];
+  
+  while (chip->peer != NULL && !chip->peer_waiting && !chip->peer_delayed &&
+         ring->frame_count < PEER_RING_FRAMES && ring->used + PN532_MAX_FRAME_DATA <= PEER_RING_SIZE) {
+    if (fgets(line, sizeof(line), chip->peer) == NULL) {
+      fclose(chip->peer);
+      chip->peer = NULL;
+      break;
+    }
+    
+    if (line[0] == '>') {
+      bool chained = line[1] == '+';
+      uint8_t frame[PN532_MAX_FRAME_DATA];
+      int length = parse_hex(&line[chained ? 2 : 1], frame, PN532_MAX_FRAME_DATA - 2);
+      peer_ring_push(chip, frame, length, chained);
+    } else if (line[0] == '<') {
+      chip->peer_expected_length = parse_hex(&line[1], chip->peer_expected, sizeof(chip->peer_expected));
+      chip->peer_waiting = true;
+    } else if (strncmp(line, "delay", 5) == 0) {
+      chip->peer_delayed = true;
+      timer_start(chip->peer_timer, strtoul(&line[5], NULL, 10) * 1000, false);
+    }
+  }
+}
+
+static void on_peer_timer(void *user_data) {
+  chip_state_t *chip = (chip_state_t *)user_data;
+  
+  chip->peer_delayed = false;
+  peer_advance(chip);
+  
+  // A held TgInitAsTarget / TgGetData may have its data now
+  if (chip->command_held && chip->peer_ring.frame_count > 0 &&
+      (chip->command == PN532_COMMAND_TGINITASTARGET || chip->command == PN532_COMMAND_TGGETDATA)) {
+    complete_held_command(chip, false);
+  }
+}
+
+// The script has ended and every frame it sent has been read
+static bool peer_finished(chip_state_t *chip) {
+  return chip->peer == NULL && !chip->peer_delayed && chip->peer_ring.frame_count == 0;
+}
+
+static void peer_ring_push(chip_state_t *chip, const uint8_t *frame, int length, bool chained) {
+  peer_ring_t *ring = &chip->peer_ring;
+  int slot = (ring->frame_head + ring->frame_count) % PEER_RING_FRAMES;
+  uint16_t tail = (ring->head + ring->used) % PEER_RING_SIZE;
+  
+  for (int i = 0; i < length; i++) {
+    ring->data[(tail + i) % PEER_RING_SIZE] = frame[i];
+  }
+  ring->used += length;
+  ring->frame_length[slot] = length;
+  ring->frame_chained[slot] = chained;
+  ring->frame_count++;
+}
+
+// Pop the next frame, and the frames chained to it while they fit in one
+// response. *more (if given) tells whether the chain goes on.
+static int peer_ring_pop(chip_state_t *chip, uint8_t *dest, bool *more) {
+  peer_ring_t *ring = &chip->peer_ring;
+  int total = 0;
+  bool chained;
+  
+  do {
+    uint16_t length = ring->frame_length[ring->frame_head];
+    chained = ring->frame_chained[ring->frame_head];
+    
+    for (int i = 0; i < length; i++) {
+      dest[total + i] = ring->data[(ring->head + i) % PEER_RING_SIZE];
+    }
+    total += length;
+    ring->head = (ring->head + length) % PEER_RING_SIZE;
+    ring->used -= length;
+    ring->frame_head = (ring->frame_head + 1) % PEER_RING_FRAMES;
+    ring->frame_count--;
+  } while (chained && more != NULL && ring->frame_count > 0 &&
+           total + ring->frame_length[ring->frame_head] <= PN532_MAX_FRAME_DATA - 2);
+  
+  if (more != NULL) {
+    *more = chained;
+  }
+  return total;
+}
+
+// Hex bytes separated by optional whitespace; returns the number of bytes
+static int parse_hex(const char *text, uint8_t *data, int max_length) {
+  int length = 0;
+  int high = -1;
+  
+  for (; *text != '\0' && length < max_length; text++) {
+    int nibble;
+    if (*text >= '0' && *text <= '9') {
+      nibble = *text - '0';
+    } else if (*text >= 'A' && *text <= 'F') {
+      nibble = *text - 'A' + 10;
+    } else if (*text >= 'a' && *text <= 'f') {
+      nibble = *text - 'a' + 10;
+    } else {
+      continue;
+    }
+    if (high < 0) {
+      high = nibble;
+    } else {
+      data[length++] = high << 4 | nibble;
+      high = -1;
+    }
+  }
+  return length;
+}
+
+// Dispatch tables, indexed by command code. For command_table min_length
+// counts command_data bytes including the command byte itself; for the card
+// command tables it counts bytes from the card command byte.
+static const command_entry_t command_table[256] = {
+  [PN532_COMMAND_GETFIRMWAREVERSION] = { handle_get_firmware_version, 1, LATENCY_GETFIRMWAREVERSION_NS },
+  [PN532_COMMAND_SAMCONFIGURATION] = { handle_sam_configuration, 2, LATENCY_SAMCONFIGURATION_NS },
+  [PN532_COMMAND_INLISTPASSIVETARGET] = { handle_in_list_passive_target, 3, LATENCY_INLISTPASSIVETARGET_NS },
+  [PN532_COMMAND_INDATAEXCHANGE] = { handle_in_data_exchange, 3, LATENCY_CARD_EXCHANGE_NS },
+  [PN532_COMMAND_INCOMMUNICATETHRU] = { handle_in_communicate_thru, 2, LATENCY_CARD_EXCHANGE_NS },
+  [PN532_COMMAND_INRELEASE] = { handle_in_release, 2, LATENCY_CARD_EXCHANGE_NS },
+  [PN532_COMMAND_INSELECT] = { handle_in_select, 2, LATENCY_CARD_EXCHANGE_NS },
+  [PN532_COMMAND_RFCONFIGURATION] = { handle_rf_configuration, 2, LATENCY_RFCONFIGURATION_NS },
+  [PN532_COMMAND_POWERDOWN] = { handle_power_down, 2, LATENCY_POWERDOWN_NS },
+  [PN532_COMMAND_INAUTOPOLL] = { handle_in_auto_poll, 4, LATENCY_INLISTPASSIVETARGET_NS },
+  [PN532_COMMAND_TGINITASTARGET] = { handle_tg_init_as_target, 2, LATENCY_INLISTPASSIVETARGET_NS },
+  [PN532_COMMAND_TGGETDATA] = { handle_tg_get_data, 1, LATENCY_CARD_EXCHANGE_NS },
+  [PN532_COMMAND_TGSETDATA] = { handle_tg_set_data, 1, LATENCY_CARD_EXCHANGE_NS },
+};
+
+static const mifare_command_entry_t classic_command_table[256] = {
+  // cmd, block, 6-byte key
+  [MIFARE_CMD_AUTH_A] = { mifare_authenticate, 2 + MIFARE_KEY_SIZE, LATENCY_MIFARE_AUTH_NS },
+  [MIFARE_CMD_AUTH_B] = { mifare_authenticate, 2 + MIFARE_KEY_SIZE, LATENCY_MIFARE_AUTH_NS },
+  [PN532_COMMAND_MIFARE_READ] = { mifare_read, 2, LATENCY_MIFARE_READ_NS },
+  [PN532_COMMAND_MIFARE_WRITE] = { mifare_write, 2 + MIFARE_CLASSIC_BLOCK_SIZE, LATENCY_MIFARE_WRITE_NS },
+  // cmd, block, flags, the sector's blocks
+  [MIFARE_CMD_WRITE_SECTOR] = { mifare_write_sector,
+                                3 + MIFARE_CLASSIC_BLOCKS_PER_SECTOR * MIFARE_CLASSIC_BLOCK_SIZE, LATENCY_MIFARE_WRITE_NS },
+};
+
+static const mifare_command_entry_t ntag_command_table[256] = {
+  [NTAG_CMD_GET_VERSION] = { ntag_get_version, 1, LATENCY_NTAG_READ_NS },
+  [NTAG_CMD_READ] = { ntag_read, 2, LATENCY_NTAG_READ_NS },
+  [NTAG_CMD_FAST_READ] = { ntag_fast_read, 3, LATENCY_NTAG_READ_NS },
+  [NTAG_CMD_WRITE] = { ntag_write, 2 + NTAG_PAGE_SIZE, LATENCY_NTAG_WRITE_NS },
+  [NTAG_CMD_COMPATIBILITY_WRITE] = { ntag_write, 2 + MIFARE_CLASSIC_BLOCK_SIZE, LATENCY_NTAG_WRITE_NS },
+};
+
+// GET_VERSION responses: header, vendor (NXP), type, subtype, major and
+// minor version, storage size, protocol
+static const uint8_t ntag213_version[NTAG_VERSION_SIZE] = {0x00, 0x04, 0x04, 0x02, 0x01, 0x00, 0x0F, 0x03};
+static const uint8_t ntag215_version[NTAG_VERSION_SIZE] = {0x00, 0x04, 0x04, 0x02, 0x01, 0x00, 0x11, 0x03};
+static const uint8_t ntag216_version[NTAG_VERSION_SIZE] = {0x00, 0x04, 0x04, 0x02, 0x01, 0x00, 0x13, 0x03};
+
+// Indexed by CARD_TYPE_*
+static const card_type_t card_types[CARD_TYPE_COUNT] = {
+  [CARD_TYPE_MIFARE_CLASSIC] = {
+    "Mifare Classic 1K", MIFARE_1K_SIZE, MIFARE_1K_SIZE / MIFARE_CLASSIC_BLOCK_SIZE, MIFARE_CLASSIC_1K_SECTORS,
+    UID_SIZE_MIFARE_CLASSIC, {0x00, 0x04}, 0x08, 0, NULL,
+    classic_command_table, classic_factory_chunk, classic_image_loaded,
+  },
+  [CARD_TYPE_MIFARE_CLASSIC_4K] = {
+    "Mifare Classic 4K", MIFARE_4K_SIZE, MIFARE_4K_SIZE / MIFARE_CLASSIC_BLOCK_SIZE, MIFARE_CLASSIC_4K_SECTORS,
+    UID_SIZE_MIFARE_CLASSIC, {0x00, 0x02}, 0x18, 0, NULL,
+    classic_command_table, classic_factory_chunk, classic_image_loaded,
+  },
+  [CARD_TYPE_MIFARE_ULTRALIGHT] = {
+    "Mifare Ultralight", MIFARE_ULTRALIGHT_SIZE, MIFARE_ULTRALIGHT_SIZE / NTAG_PAGE_SIZE, 0,
+    UID_SIZE_NTAG, {0x00, 0x44}, 0x00, 0x06, NULL,
+    ntag_command_table, ntag_factory_chunk, ntag_image_loaded,
+  },
+  [CARD_TYPE_NTAG213] = {
+    "NTAG213", NTAG213_SIZE, NTAG213_SIZE / NTAG_PAGE_SIZE, 0,
+    UID_SIZE_NTAG, {0x00, 0x44}, 0x00, 0x12, ntag213_version,
+    ntag_command_table, ntag_factory_chunk, ntag_image_loaded,
+  },
+  [CARD_TYPE_NTAG215] = {
+    "NTAG215", NTAG215_SIZE, NTAG215_SIZE / NTAG_PAGE_SIZE, 0,
+    UID_SIZE_NTAG, {0x00, 0x44}, 0x00, 0x3E, ntag215_version,
+    ntag_command_table, ntag_factory_chunk, ntag_image_loaded,
+  },
+  [CARD_TYPE_NTAG216] = {
+    "NTAG216", NTAG216_SIZE, NTAG216_SIZE / NTAG_PAGE_SIZE, 0,
+    UID_SIZE_NTAG, {0x00, 0x44}, 0x00, 0x6D, ntag216_version,
+    ntag_command_table, ntag_factory_chunk, ntag_image_loaded,
+  },
+};
+
+static void process_command(chip_state_t *chip) {
+  const command_entry_t *entry = &command_table[chip->command];
+  
+  LOG_TRACE(chip, "Processing command: 0x%02X\n", chip->command);
+  
+  if (entry->handler == NULL || chip->command_length < entry->min_length) {
+    LOG_ERROR(chip, "Unsupported or truncated command: 0x%02X\n", chip->command);
+    chip->response_latency_ns = LATENCY_SYNTAX_ERROR_NS;
+    build_error_frame(chip);
+    return;
+  }
+  
+  chip->response_data[0] = chip->command + 1; // Response code
+  chip->response_length = 1;
+  chip->response_fragment_count = 0;
+  chip->response_payload_length = 0;
+  chip->response_latency_ns = entry->latency_ns;
+  chip->command_rejected = false;
+  entry->handler(chip);
+  if (chip->command_rejected) {
+    chip->response_latency_ns = LATENCY_SYNTAX_ERROR_NS;
+    build_error_frame(chip);
+    return;
+  }
+  if (chip->command_held) {
+    chip->response_length = 0; // ACK now, the response when the command completes
+    chip->response_payload_length = 0;
+  }
+  
+  build_tx_frame(chip);
+}
+
+// Lay out the ACK followed by the PN532 syntax error frame
+static void build_error_frame(chip_state_t *chip) {
+  static const uint8_t ack_packet[] = PN532_ACK_PACKET;
+  static const uint8_t error_packet[] = PN532_ERROR_PACKET;
+  
+  response_slot_t *slot = running_response(chip);
+  
+  memcpy(slot->data, ack_packet, PN532_ACK_PACKET_SIZE);
+  memcpy(slot->data + PN532_ACK_PACKET_SIZE, error_packet, PN532_ERROR_PACKET_SIZE);
+  slot->length = PN532_ACK_PACKET_SIZE + PN532_ERROR_PACKET_SIZE;
+}
+
+// Lay out the ACK and the complete response frame so reads are plain indexed
+// loads. Payload fragments are copied whole and bring their own byte sums.
+static void build_tx_frame(chip_state_t *chip) {
+  static const uint8_t ack_packet[] = PN532_ACK_PACKET;
+  response_slot_t *slot = running_response(chip);
+  uint8_t *tx = slot->data;
+  uint16_t length = 0;
+  
+  memcpy(tx, ack_packet, PN532_ACK_PACKET_SIZE);
+  length = PN532_ACK_PACKET_SIZE;
+  
+  if (chip->response_length > 0) {
+    uint16_t frame_length = chip->response_length + chip->response_payload_length + 1; // TFI + response data
+    uint8_t sum = PN532_PN532TOHOST;
+    
+    tx[length++] = PN532_PREAMBLE;
+    tx[length++] = PN532_STARTCODE1;
+    tx[length++] = PN532_STARTCODE2;
+    if (frame_length <= PN532_MAX_NORMAL_FRAME_LENGTH) {
+      tx[length++] = frame_length;
+      tx[length++] = ~frame_length + 1; // Length checksum
+    } else {
+      // Extended frame
+      uint8_t length_msb = frame_length >> 8;
+      uint8_t length_lsb = frame_length & 0xFF;
+      tx[length++] = 0xFF;
+      tx[length++] = 0xFF;
+      tx[length++] = length_msb;
+      tx[length++] = length_lsb;
+      tx[length++] = ~(length_msb + length_lsb) + 1; // Length checksum
+    }
+    tx[length++] = PN532_PN532TOHOST; // TFI
+    for (int i = 0; i < chip->response_length; i++) {
+      tx[length++] = chip->response_data[i];
+      sum += chip->response_data[i];
+    }
+    for (int f = 0; f < chip->response_fragment_count; f++) {
+      const response_fragment_t *fragment = &chip->response_fragments[f];
+      memcpy(&tx[length], fragment->data, fragment->length);
+      length += fragment->length;
+      sum += fragment->sum;
+    }
+    tx[length++] = ~sum + 1; // Data checksum
+    tx[length++] = PN532_POSTAMBLE;
+  }
+  
+  slot->length = length;
+}
+
+static bool authenticate_sector(chip_state_t *chip, virtual_card_t *card, int sector,
+                                uint8_t key_type, const uint8_t *key) {
+  if (sector < 0 || sector >= card_type_of(card)->sector_count) {
     return false;
   }
   
   // Get the sector trailer block
-  int trailer_block = (sector * MIFARE_CLASSIC_BLOCKS_PER_SECTOR) + (MIFARE_CLASSIC_BLOCKS_PER_SECTOR - 1);
-  int trailer_offset = trailer_block * MIFARE_CLASSIC_BLOCK_SIZE;
+  int trailer_block = classic_sector_trailer(sector);
+  const uint8_t *trailer = card_data(chip, card, trailer_block * MIFARE_CLASSIC_BLOCK_SIZE);
   
   // Compare with stored keys (Key A or Key B based on command)
-  uint8_t *stored_key;
-  if (chip->last_command == 0x60) { // Auth with Key A
-    stored_key = &chip->cards[card_index].memory[trailer_offset]; // First 6 bytes
+  const uint8_t *stored_key;
+  if (key_type == MIFARE_CMD_AUTH_A) { // Auth with Key A
+    stored_key = &trailer[0]; // First 6 bytes
   } else { // Auth with Key B
-    stored_key = &chip->cards[card_index].memory[trailer_offset + 10]; // Last 6 bytes
+    stored_key = &trailer[10]; // Last 6 bytes
   }
   
   // Compare keys